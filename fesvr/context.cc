@@ -1,22 +1,297 @@
 #include "context.h"
 #include <assert.h>
 #include <sched.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <mutex>
+#include <new>
+#include <vector>
+#if !defined(USE_FAST_CONTEXT) && !defined(USE_UCONTEXT) && defined(__linux__)
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif
 
 static __thread context_t* cur;
 
+#ifdef USE_FAST_CONTEXT
+
+// fesvr_context_switch(void** save_sp, void* new_sp) pushes the callee-saved
+// registers onto the current stack, stores the stack pointer to *save_sp,
+// then switches to new_sp and pops the registers saved there.  A new
+// context's stack is seeded so that this "returns" into
+// fesvr_context_start, which calls the function in the second saved
+// register with the first saved register as its argument.
+extern "C" void fesvr_context_switch(void** save_sp, void* new_sp);
+
+asm(
+  ".text\n"
+  ".globl fesvr_context_switch\n"
+  ".hidden fesvr_context_switch\n"
+  ".type fesvr_context_switch, %function\n"
+  ".type fesvr_context_start, %function\n"
+#if defined(__x86_64__)
+  ".align 16\n"
+  "fesvr_context_switch:\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  subq $8, %rsp\n"
+  "  stmxcsr (%rsp)\n"
+  "  fnstcw 4(%rsp)\n"
+  "  movq %rsp, (%rdi)\n"
+  "  movq %rsi, %rsp\n"
+  "  ldmxcsr (%rsp)\n"
+  "  fldcw 4(%rsp)\n"
+  "  addq $8, %rsp\n"
+  "  popq %r15\n"
+  "  popq %r14\n"
+  "  popq %r13\n"
+  "  popq %r12\n"
+  "  popq %rbx\n"
+  "  popq %rbp\n"
+  "  ret\n"
+  "fesvr_context_start:\n"
+  "  movq %rbx, %rdi\n"
+  "  call *%r12\n"
+  "  ud2\n"
+#elif defined(__aarch64__)
+  ".align 4\n"
+  "fesvr_context_switch:\n"
+  "  sub sp, sp, #160\n"
+  "  stp x19, x20, [sp, #0]\n"
+  "  stp x21, x22, [sp, #16]\n"
+  "  stp x23, x24, [sp, #32]\n"
+  "  stp x25, x26, [sp, #48]\n"
+  "  stp x27, x28, [sp, #64]\n"
+  "  stp x29, x30, [sp, #80]\n"
+  "  stp d8, d9, [sp, #96]\n"
+  "  stp d10, d11, [sp, #112]\n"
+  "  stp d12, d13, [sp, #128]\n"
+  "  stp d14, d15, [sp, #144]\n"
+  "  mov x2, sp\n"
+  "  str x2, [x0]\n"
+  "  mov sp, x1\n"
+  "  ldp x19, x20, [sp, #0]\n"
+  "  ldp x21, x22, [sp, #16]\n"
+  "  ldp x23, x24, [sp, #32]\n"
+  "  ldp x25, x26, [sp, #48]\n"
+  "  ldp x27, x28, [sp, #64]\n"
+  "  ldp x29, x30, [sp, #80]\n"
+  "  ldp d8, d9, [sp, #96]\n"
+  "  ldp d10, d11, [sp, #112]\n"
+  "  ldp d12, d13, [sp, #128]\n"
+  "  ldp d14, d15, [sp, #144]\n"
+  "  add sp, sp, #160\n"
+  "  ret\n"
+  "fesvr_context_start:\n"
+  "  mov x0, x19\n"
+  "  blr x20\n"
+  "  brk #0\n"
+#elif defined(__riscv)
+  ".align 2\n"
+  "fesvr_context_switch:\n"
+  "  addi sp, sp, -208\n"
+  "  sd ra, 0(sp)\n"
+  "  sd s0, 8(sp)\n"
+  "  sd s1, 16(sp)\n"
+  "  sd s2, 24(sp)\n"
+  "  sd s3, 32(sp)\n"
+  "  sd s4, 40(sp)\n"
+  "  sd s5, 48(sp)\n"
+  "  sd s6, 56(sp)\n"
+  "  sd s7, 64(sp)\n"
+  "  sd s8, 72(sp)\n"
+  "  sd s9, 80(sp)\n"
+  "  sd s10, 88(sp)\n"
+  "  sd s11, 96(sp)\n"
+#ifdef __riscv_float_abi_double
+  "  fsd fs0, 104(sp)\n"
+  "  fsd fs1, 112(sp)\n"
+  "  fsd fs2, 120(sp)\n"
+  "  fsd fs3, 128(sp)\n"
+  "  fsd fs4, 136(sp)\n"
+  "  fsd fs5, 144(sp)\n"
+  "  fsd fs6, 152(sp)\n"
+  "  fsd fs7, 160(sp)\n"
+  "  fsd fs8, 168(sp)\n"
+  "  fsd fs9, 176(sp)\n"
+  "  fsd fs10, 184(sp)\n"
+  "  fsd fs11, 192(sp)\n"
+#endif
+  "  sd sp, 0(a0)\n"
+  "  mv sp, a1\n"
+  "  ld ra, 0(sp)\n"
+  "  ld s0, 8(sp)\n"
+  "  ld s1, 16(sp)\n"
+  "  ld s2, 24(sp)\n"
+  "  ld s3, 32(sp)\n"
+  "  ld s4, 40(sp)\n"
+  "  ld s5, 48(sp)\n"
+  "  ld s6, 56(sp)\n"
+  "  ld s7, 64(sp)\n"
+  "  ld s8, 72(sp)\n"
+  "  ld s9, 80(sp)\n"
+  "  ld s10, 88(sp)\n"
+  "  ld s11, 96(sp)\n"
+#ifdef __riscv_float_abi_double
+  "  fld fs0, 104(sp)\n"
+  "  fld fs1, 112(sp)\n"
+  "  fld fs2, 120(sp)\n"
+  "  fld fs3, 128(sp)\n"
+  "  fld fs4, 136(sp)\n"
+  "  fld fs5, 144(sp)\n"
+  "  fld fs6, 152(sp)\n"
+  "  fld fs7, 160(sp)\n"
+  "  fld fs8, 168(sp)\n"
+  "  fld fs9, 176(sp)\n"
+  "  fld fs10, 184(sp)\n"
+  "  fld fs11, 192(sp)\n"
+#endif
+  "  addi sp, sp, 208\n"
+  "  ret\n"
+  "fesvr_context_start:\n"
+  "  mv a0, s1\n"
+  "  jalr s2\n"
+  "  ebreak\n"
+#endif
+  ".size fesvr_context_switch, fesvr_context_start - fesvr_context_switch\n"
+);
+
+extern "C" char fesvr_context_start[];
+
+// Build the register frame fesvr_context_switch expects at the top of a
+// fresh stack.  top must be 16-byte aligned.
+static void* fesvr_context_frame(char* top, context_t* ctx, void (*entry)(context_t*))
+{
+  uintptr_t* sp;
+#if defined(__x86_64__)
+  // mxcsr/fcw, r15, r14, r13, r12, rbx, rbp, return address
+  sp = (uintptr_t*)top - 8;
+  sp[0] = 0x037f00001f80; // default fcw and mxcsr
+  sp[4] = (uintptr_t)entry; // r12
+  sp[5] = (uintptr_t)ctx; // rbx
+  sp[6] = 0; // rbp
+  sp[7] = (uintptr_t)fesvr_context_start;
+#elif defined(__aarch64__)
+  // x19-x28, x29, x30, d8-d15
+  sp = (uintptr_t*)top - 20;
+  for (int i = 0; i < 20; i++)
+    sp[i] = 0;
+  sp[0] = (uintptr_t)ctx; // x19
+  sp[1] = (uintptr_t)entry; // x20
+  sp[11] = (uintptr_t)fesvr_context_start; // x30
+#elif defined(__riscv)
+  // ra, s0-s11, fs0-fs11, padding
+  sp = (uintptr_t*)top - 26;
+  for (int i = 0; i < 26; i++)
+    sp[i] = 0;
+  sp[0] = (uintptr_t)fesvr_context_start; // ra
+  sp[2] = (uintptr_t)ctx; // s1
+  sp[3] = (uintptr_t)entry; // s2
+#endif
+  return sp;
+}
+
+#endif
+
+#if defined(USE_FAST_CONTEXT) || defined(USE_UCONTEXT)
+// Stacks are mmap'd with an inaccessible guard page at the bottom, so an
+// overflow faults instead of corrupting the heap.  Released stacks are kept
+// in a small pool, since simulators often create and destroy many contexts.
+// The pool itself is never freed, so contexts may outlive static destructors.
+static const size_t STACK_POOL_MAX = 16;
+
+struct stack_pool_t
+{
+  std::mutex lock;
+  std::vector<std::pair<char*, size_t>> stacks;
+};
+
+static stack_pool_t& stack_pool()
+{
+  static stack_pool_t* pool = new stack_pool_t;
+  return *pool;
+}
+
+static size_t stack_guard_size()
+{
+  static size_t page = sysconf(_SC_PAGESIZE);
+  return page;
+}
+
+static char* alloc_stack(size_t len)
+{
+  {
+    stack_pool_t& pool = stack_pool();
+    std::lock_guard<std::mutex> guard(pool.lock);
+    for (size_t i = 0; i < pool.stacks.size(); i++)
+    {
+      if (pool.stacks[i].second == len)
+      {
+        char* stack = pool.stacks[i].first;
+        pool.stacks[i] = pool.stacks.back();
+        pool.stacks.pop_back();
+        return stack;
+      }
+    }
+  }
+
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_STACK
+  flags |= MAP_STACK;
+#endif
+  void* p = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (p == MAP_FAILED)
+    throw std::bad_alloc();
+  if (mprotect(p, stack_guard_size(), PROT_NONE) != 0)
+    abort();
+  return (char*)p;
+}
+
+static void free_stack(char* stack, size_t len)
+{
+  {
+    stack_pool_t& pool = stack_pool();
+    std::lock_guard<std::mutex> guard(pool.lock);
+    if (pool.stacks.size() < STACK_POOL_MAX)
+    {
+      pool.stacks.push_back(std::make_pair(stack, len));
+      return;
+    }
+  }
+  munmap(stack, len);
+}
+#endif
+
 context_t::context_t()
   : creator(NULL), func(NULL), arg(NULL),
-#ifndef USE_UCONTEXT
+#if defined(USE_FAST_CONTEXT)
+    stack(NULL), stack_size(0), sp(NULL)
+#elif !defined(USE_UCONTEXT)
     mutex(PTHREAD_MUTEX_INITIALIZER),
-    cond(PTHREAD_COND_INITIALIZER), flag(0)
+    cond(PTHREAD_COND_INITIALIZER), flag(WAITING)
 #else
-    context(new ucontext_t)
+    stack(NULL), stack_size(0), context(new ucontext_t)
 #endif
 {
 }
 
-#ifdef USE_UCONTEXT
+#if defined(USE_FAST_CONTEXT)
+void context_t::wrapper(context_t* ctx)
+{
+  ctx->creator->switch_to();
+  ctx->func(ctx->arg);
+  // like ucontext's uc_link, return control to the creator for good
+  ctx->creator->switch_to();
+  abort();
+}
+#elif defined(USE_UCONTEXT)
 #ifndef GLIBC_64BIT_PTR_BUG
 void context_t::wrapper(context_t* ctx)
 {
@@ -38,19 +313,101 @@ void* context_t::wrapper(void* a)
   ctx->func(ctx->arg);
   return NULL;
 }
+
+// Only one context runs at a time, so a handoff is a store on one side and
+// a wait on the other.  The waiter spins briefly, since the other thread
+// usually hands control back within microseconds, then sleeps in the
+// kernel.  The waker only enters the kernel if the waiter actually slept.
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  asm volatile ("yield");
+#endif
+}
+
+// Spinning only pays off if the other thread can run concurrently.
+static unsigned compute_spin_limit()
+{
+  static const unsigned SPIN_COUNT = 4096;
+#if defined(__linux__) && defined(CPU_COUNT)
+  cpu_set_t cpus;
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+    return CPU_COUNT(&cpus) > 1 ? SPIN_COUNT : 0;
 #endif
+  return sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_COUNT : 0;
+}
+
+static unsigned spin_limit()
+{
+  // both threads of a handoff get here; C++11 makes this initialization safe
+  static const unsigned limit = compute_spin_limit();
+  return limit;
+}
 
-void context_t::init(void (*f)(void*), void* a)
+void context_t::wait()
+{
+  for (unsigned i = spin_limit(); i > 0; i--)
+  {
+    if (flag.load(std::memory_order_acquire) == RUNNABLE)
+      return;
+    cpu_relax();
+  }
+
+  int expected = WAITING;
+  if (!flag.compare_exchange_strong(expected, SLEEPING))
+    return; // woken while we were spinning
+
+#ifdef __linux__
+  while (flag.load(std::memory_order_acquire) != RUNNABLE)
+    syscall(SYS_futex, &flag, FUTEX_WAIT_PRIVATE, SLEEPING, NULL, NULL, 0);
+#else
+  pthread_mutex_lock(&mutex);
+  while (flag.load(std::memory_order_acquire) != RUNNABLE)
+    pthread_cond_wait(&cond, &mutex);
+  pthread_mutex_unlock(&mutex);
+#endif
+}
+
+void context_t::wake()
+{
+  if (flag.exchange(RUNNABLE) != SLEEPING)
+    return;
+
+#ifdef __linux__
+  syscall(SYS_futex, &flag, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+  pthread_mutex_lock(&mutex);
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&mutex);
+#endif
+}
+#endif
+
+void context_t::init(void (*f)(void*), void* a, size_t size)
 {
   func = f;
   arg = a;
   creator = current();
 
-#ifdef USE_UCONTEXT
+#if defined(USE_FAST_CONTEXT) || defined(USE_UCONTEXT)
+  size_t guard = stack_guard_size();
+  assert(stack == NULL);
+  stack_size = (size + guard - 1) / guard * guard + guard;
+  stack = alloc_stack(stack_size);
+#endif
+
+#if defined(USE_FAST_CONTEXT)
+  char* top = (char*)((uintptr_t)(stack + stack_size) & -16);
+  sp = fesvr_context_frame(top, this, &context_t::wrapper);
+  switch_to();
+#elif defined(USE_UCONTEXT)
   getcontext(context.get());
   context->uc_link = creator->context.get();
-  context->uc_stack.ss_size = 64*1024;
-  context->uc_stack.ss_sp = new void*[context->uc_stack.ss_size/sizeof(void*)];
+  context->uc_stack.ss_size = stack_size - guard;
+  context->uc_stack.ss_sp = stack + guard;
 #ifndef GLIBC_64BIT_PTR_BUG
   makecontext(context.get(), (void(*)(void))&context_t::wrapper, 1, this);
 #else
@@ -60,42 +417,47 @@ void context_t::init(void (*f)(void*), void* a)
 #endif
   switch_to();
 #else
-  assert(flag == 0);
+  assert(flag == WAITING);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, size < PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN : size);
 
-  pthread_mutex_lock(&creator->mutex);
-  creator->flag = 0;
-  if (pthread_create(&thread, NULL, &context_t::wrapper, this) != 0)
+  creator->flag = WAITING;
+  if (pthread_create(&thread, &attr, &context_t::wrapper, this) != 0)
     abort();
+  pthread_attr_destroy(&attr);
   pthread_detach(thread);
-  while (!creator->flag)
-    pthread_cond_wait(&creator->cond, &creator->mutex);
-  pthread_mutex_unlock(&creator->mutex);
+  creator->wait();
 #endif
 }
 
 context_t::~context_t()
 {
   assert(this != cur);
+#if defined(USE_FAST_CONTEXT) || defined(USE_UCONTEXT)
+  if (stack)
+    free_stack(stack, stack_size);
+#endif
 }
 
 void context_t::switch_to()
 {
   assert(this != cur);
-#ifdef USE_UCONTEXT
+#if defined(USE_FAST_CONTEXT)
+  context_t* prev = cur;
+  cur = this;
+  fesvr_context_switch(&prev->sp, sp);
+#elif defined(USE_UCONTEXT)
   context_t* prev = cur;
   cur = this;
   if (swapcontext(prev->context.get(), context.get()) != 0)
     abort();
 #else
-  cur->flag = 0;
-  this->flag = 1;
-  pthread_mutex_lock(&this->mutex);
-  pthread_cond_signal(&this->cond);
-  pthread_mutex_unlock(&this->mutex);
-  pthread_mutex_lock(&cur->mutex);
-  while (!cur->flag)
-    pthread_cond_wait(&cur->cond, &cur->mutex);
-  pthread_mutex_unlock(&cur->mutex);
+  context_t* prev = cur;
+  prev->flag = WAITING;
+  wake();
+  prev->wait();
 #endif
 }
 
@@ -104,11 +466,13 @@ context_t* context_t::current()
   if (cur == NULL)
   {
     cur = new context_t;
-#ifdef USE_UCONTEXT
+#if defined(USE_FAST_CONTEXT)
+    // sp is filled in when this context first switches away
+#elif defined(USE_UCONTEXT)
     getcontext(cur->context.get());
 #else
     cur->thread = pthread_self();
-    cur->flag = 1;
+    cur->flag = RUNNABLE;
 #endif
   }
   return cur;
@@ -4,8 +4,18 @@
 // A replacement for ucontext.h, which is sadly deprecated.
 
 #include <pthread.h>
+#include <stddef.h>
 
-#if defined(__GLIBC__)
+// On ELF targets for which a hand-written switch exists, contexts switch by
+// saving only the callee-saved registers, avoiding the signal-mask syscall
+// that swapcontext makes.  Define DISABLE_FAST_CONTEXT to use ucontext.
+#if !defined(DISABLE_FAST_CONTEXT) && defined(__ELF__) && \
+    (defined(__x86_64__) || defined(__aarch64__) || \
+     (defined(__riscv) && __riscv_xlen == 64 && \
+      (defined(__riscv_float_abi_double) || defined(__riscv_float_abi_soft))))
+# undef USE_FAST_CONTEXT
+# define USE_FAST_CONTEXT
+#elif defined(__GLIBC__)
 # undef USE_UCONTEXT
 # define USE_UCONTEXT
 # include <ucontext.h>
@@ -21,6 +31,8 @@ static_assert (sizeof(void*)         == 8, "ptr size doesn't match expected 64bi
 #endif
 #endif /* ULONG_MAX > UINT_MAX */
 
+#else
+# include <atomic>
 #endif
 
 class context_t
@@ -28,14 +40,27 @@ class context_t
  public:
   context_t();
   ~context_t();
-  void init(void (*func)(void*), void* arg);
+  void init(void (*func)(void*), void* arg,
+            size_t stack_size = DEFAULT_STACK_SIZE);
   void switch_to();
   static context_t* current();
+
+  static const size_t DEFAULT_STACK_SIZE = 64*1024;
+  static const size_t MIN_STACK_SIZE = 16*1024;
+
  private:
   context_t* creator;
   void (*func)(void*);
   void* arg;
-#ifdef USE_UCONTEXT
+#if defined(USE_FAST_CONTEXT) || defined(USE_UCONTEXT)
+  // mmap'd region, including the guard page below the stack
+  char* stack;
+  size_t stack_size;
+#endif
+#if defined(USE_FAST_CONTEXT)
+  void* sp;
+  static void wrapper(context_t*);
+#elif defined(USE_UCONTEXT)
   std::unique_ptr<ucontext_t> context;
 #ifndef GLIBC_64BIT_PTR_BUG
   static void wrapper(context_t*);
@@ -46,7 +71,12 @@ class context_t
   pthread_t thread;
   pthread_mutex_t mutex;
   pthread_cond_t cond;
-  volatile int flag;
+  // RUNNABLE when this context may run; SLEEPING when its thread is
+  // blocked in wait() and must be woken explicitly
+  enum { WAITING, RUNNABLE, SLEEPING };
+  std::atomic<int> flag;
+  void wait();
+  void wake();
   static void* wrapper(void*);
 #endif
 };
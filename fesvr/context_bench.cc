@@ -0,0 +1,95 @@
+// See LICENSE for license details.
+
+// Microbenchmark of context_t switching: times N round trips between the
+// main context and a coroutine with whichever backend context.h selected,
+// and, where available, the same loop on raw swapcontext for reference.
+// Build with "make context_bench"; run as "./context_bench [N]".
+
+#include "context.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef __GLIBC__
+# include <ucontext.h>
+#endif
+
+static const char* backend()
+{
+#if defined(USE_FAST_CONTEXT)
+  return "fast";
+#elif defined(USE_UCONTEXT)
+  return "ucontext";
+#else
+  return "pthread";
+#endif
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void report(const char* name, long n, double secs)
+{
+  printf("%-20s %10ld round trips in %.3f s: %7.2f M/s, %6.1f ns each\n",
+         name, n, secs, n / secs / 1e6, secs / n * 1e9);
+}
+
+static context_t* main_context;
+static long switches;
+
+static void bounce(void*)
+{
+  while (true)
+  {
+    switches++;
+    main_context->switch_to();
+  }
+}
+
+#ifdef __GLIBC__
+static ucontext_t uc_main, uc_other;
+
+static void uc_bounce()
+{
+  while (true)
+    swapcontext(&uc_other, &uc_main);
+}
+#endif
+
+int main(int argc, char** argv)
+{
+  long n = argc > 1 ? atol(argv[1]) : 1000000;
+
+  main_context = context_t::current();
+  context_t other;
+  other.init(bounce, NULL);
+  other.switch_to(); // warm up, and start the coroutine
+
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < n; i++)
+    other.switch_to();
+  double secs = seconds_since(start);
+  if (switches != n + 1)
+    abort();
+  char name[32];
+  snprintf(name, sizeof(name), "context_t (%s)", backend());
+  report(name, n, secs);
+
+#ifdef __GLIBC__
+  static char stack[64*1024];
+  getcontext(&uc_other);
+  uc_other.uc_stack.ss_sp = stack;
+  uc_other.uc_stack.ss_size = sizeof(stack);
+  uc_other.uc_link = NULL;
+  makecontext(&uc_other, uc_bounce, 0);
+  swapcontext(&uc_main, &uc_other);
+
+  start = std::chrono::steady_clock::now();
+  for (long i = 0; i < n; i++)
+    swapcontext(&uc_main, &uc_other);
+  report("swapcontext", n, seconds_since(start));
+#endif
+
+  return 0;
+}
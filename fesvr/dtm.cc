@@ -1,11 +1,14 @@
 #include "dtm.h"
 #include "debug_defines.h"
 #include "encoding.h"
+#include <algorithm>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <stdexcept>
 #include <pthread.h>
+#include <sched.h>
 
 #define RV_X(x, s, n) \
   (((x) >> (s)) & ((1 << (n)) - 1))
@@ -37,8 +40,14 @@
 #define S1 9
 
 #define AC_AR_REGNO(x) ((0x1000 | x) << AC_ACCESS_REGISTER_REGNO_OFFSET)
+#define AC_AR_CSR(x)   ((x) << AC_ACCESS_REGISTER_REGNO_OFFSET)
 #define AC_AR_SIZE(x)  (((x == 128)? 4 : (x == 64 ? 3 : 2)) << AC_ACCESS_REGISTER_SIZE_OFFSET)
 
+#define CMDERR_NOTSUP 2
+#define SBERROR_BUSY 4
+#define SBA_BATCH 64
+#define SBA_MAX_STALLS 1000
+
 #define WRITE 1
 #define SET 2
 #define CLEAR 3
@@ -56,12 +65,28 @@
 
 uint32_t dtm_t::do_command(dtm_t::req r)
 {
-  req_buf = r;
-  target->switch_to();
+  if (host_is_threaded()) {
+    while (!req_queue.push(r))
+      wait_for_target();
+    while (!resp_queue.pop(resp_buf))
+      wait_for_target();
+  } else {
+    req_buf = r;
+    target->switch_to();
+  }
   assert(resp_buf.resp == 0);
   return resp_buf.data;
 }
 
+// Yield to the simulator thread, unless the dtm_t is being destroyed, in
+// which case unwind the host thread back to host_pthread_main.
+void dtm_t::wait_for_target()
+{
+  if (stop_host.load(std::memory_order_relaxed))
+    throw host_stopped_t();
+  sched_yield();
+}
+
 uint32_t dtm_t::read(uint32_t addr)
 {
   return do_command((req){addr, 1, 0});
@@ -77,9 +102,35 @@ void dtm_t::nop()
   do_command((req){0, 0, 0});
 }
 
+void dtm_t::write_dmcontrol(uint32_t value)
+{
+  write(DMI_DMCONTROL, value);
+  dmcontrol = value & ~(DMI_DMCONTROL_HALTREQ | DMI_DMCONTROL_RESUMEREQ);
+  // clearing dmactive resets the debug module, program buffer included
+  if (!(value & DMI_DMCONTROL_DMACTIVE))
+    progbuf_valid = 0;
+}
+
+// Read dmstatus to avoid back-to-back writes to dmcontrol, for debug
+// modules that need the spacing.
+void dtm_t::space_dmcontrol()
+{
+  if (dmi_spacing)
+    read(DMI_DMSTATUS);
+}
+
 void dtm_t::select_hart(int hartsel) {
+  if (!dmi_spacing) {
+    if (hartsel != current_hart)
+      release_hart();
+    if (get_field(dmcontrol, DMI_DMCONTROL_HARTSEL) != (uint32_t)hartsel)
+      write_dmcontrol(set_field(dmcontrol, DMI_DMCONTROL_HARTSEL, hartsel));
+    current_hart = hartsel;
+    return;
+  }
+
   int dmcontrol = read(DMI_DMCONTROL);
-  write (DMI_DMCONTROL, set_field(dmcontrol, DMI_DMCONTROL_HARTSEL, hartsel));
+  write_dmcontrol(set_field(dmcontrol, DMI_DMCONTROL_HARTSEL, hartsel));
   current_hart = hartsel;
 }
 
@@ -87,7 +138,9 @@ int dtm_t::enumerate_harts() {
   int max_hart = (1 << DMI_DMCONTROL_HARTSEL_LENGTH) - 1;
   write(DMI_DMCONTROL, set_field(read(DMI_DMCONTROL), DMI_DMCONTROL_HARTSEL, max_hart));
   read(DMI_DMSTATUS);
-  max_hart = get_field(read(DMI_DMCONTROL), DMI_DMCONTROL_HARTSEL);
+  dmcontrol = read(DMI_DMCONTROL);
+  max_hart = get_field(dmcontrol, DMI_DMCONTROL_HARTSEL);
+  current_hart = max_hart;
 
   int hartsel;
   for (hartsel = 0; hartsel <= max_hart; hartsel++) {
@@ -101,45 +154,108 @@ int dtm_t::enumerate_harts() {
 
 void dtm_t::halt(int hartsel)
 {
+  // Unless the debug module needs every access bracketed by a halt and a
+  // resume, the hart stays halted until release_hart().
+  if (halted && hartsel == current_hart && !dmi_spacing)
+    return;
+  if (halted)
+    release_hart();
+
   if (running) {
-    write(DMI_DMCONTROL, DMI_DMCONTROL_DMACTIVE);
-    // Read dmstatus to avoid back-to-back writes to dmcontrol.
-    read(DMI_DMSTATUS);
+    write_dmcontrol(DMI_DMCONTROL_DMACTIVE);
+    space_dmcontrol();
   }
 
   int dmcontrol = DMI_DMCONTROL_HALTREQ | DMI_DMCONTROL_DMACTIVE;
   dmcontrol = set_field(dmcontrol, DMI_DMCONTROL_HARTSEL, hartsel);
-  write(DMI_DMCONTROL, dmcontrol);
+  write_dmcontrol(dmcontrol);
   int dmstatus;
   do {
     dmstatus = read(DMI_DMSTATUS);
   } while(get_field(dmstatus, DMI_DMSTATUS_ALLHALTED) == 0);
   dmcontrol &= ~DMI_DMCONTROL_HALTREQ;
-  write(DMI_DMCONTROL, dmcontrol);
-  // Read dmstatus to avoid back-to-back writes to dmcontrol.
-  read(DMI_DMSTATUS);
+  write_dmcontrol(dmcontrol);
+  space_dmcontrol();
   current_hart = hartsel;
+  halted = true;
 }
 
 void dtm_t::resume(int hartsel)
 {
+  assert(hartsel == current_hart);
+  if (dmi_spacing)
+    release_hart();
+}
+
+// Resume the hart left halted by halt(), if any.
+void dtm_t::release_hart()
+{
+  if (!halted)
+    return;
+
   int dmcontrol = DMI_DMCONTROL_RESUMEREQ | DMI_DMCONTROL_DMACTIVE;
-  dmcontrol = set_field(dmcontrol, DMI_DMCONTROL_HARTSEL, hartsel);
-  write(DMI_DMCONTROL, dmcontrol);
+  dmcontrol = set_field(dmcontrol, DMI_DMCONTROL_HARTSEL, current_hart);
+  write_dmcontrol(dmcontrol);
   int dmstatus;
   do {
     dmstatus = read(DMI_DMSTATUS);
   } while (get_field(dmstatus, DMI_DMSTATUS_ALLRESUMEACK) == 0);
   dmcontrol &= ~DMI_DMCONTROL_RESUMEREQ;
-  write(DMI_DMCONTROL, dmcontrol);
-  // Read dmstatus to avoid back-to-back writes to dmcontrol.
-  read(DMI_DMSTATUS);
-  current_hart = hartsel;
+  write_dmcontrol(dmcontrol);
+  space_dmcontrol();
+  halted = false;
 
   if (running) {
-    write(DMI_DMCONTROL, 0);
-    // Read dmstatus to avoid back-to-back writes to dmcontrol.
-    read(DMI_DMSTATUS);
+    write_dmcontrol(0);
+    space_dmcontrol();
+  }
+}
+
+// Add every hart to the hart array mask and select it alongside hartsel.
+// Returns false if the debug module has no hart array mask.
+bool dtm_t::select_all_harts()
+{
+  write_dmcontrol(DMI_DMCONTROL_DMACTIVE | DMI_DMCONTROL_HASEL);
+  if (!get_field(read(DMI_DMCONTROL), DMI_DMCONTROL_HASEL))
+    return false;
+
+  for (int window = 0; window * 32 < num_harts; window++) {
+    int n = std::min(num_harts - window * 32, 32);
+    write(DMI_HAWINDOWSEL, window);
+    write(DMI_HAWINDOW, n == 32 ? 0xffffffff : (1U << n) - 1);
+  }
+  return true;
+}
+
+void dtm_t::halt_all_harts()
+{
+  int dmcontrol = DMI_DMCONTROL_HALTREQ | DMI_DMCONTROL_DMACTIVE | DMI_DMCONTROL_HASEL;
+  write_dmcontrol(dmcontrol);
+  int dmstatus;
+  do {
+    dmstatus = read(DMI_DMSTATUS);
+  } while(get_field(dmstatus, DMI_DMSTATUS_ALLHALTED) == 0);
+  dmcontrol &= ~DMI_DMCONTROL_HALTREQ;
+  write_dmcontrol(dmcontrol);
+  space_dmcontrol();
+}
+
+void dtm_t::resume_all_harts()
+{
+  int dmcontrol = DMI_DMCONTROL_RESUMEREQ | DMI_DMCONTROL_DMACTIVE | DMI_DMCONTROL_HASEL;
+  write_dmcontrol(dmcontrol);
+  int dmstatus;
+  do {
+    dmstatus = read(DMI_DMSTATUS);
+  } while (get_field(dmstatus, DMI_DMSTATUS_ALLRESUMEACK) == 0);
+  dmcontrol &= ~(DMI_DMCONTROL_RESUMEREQ | DMI_DMCONTROL_HASEL);
+  write_dmcontrol(dmcontrol);
+  space_dmcontrol();
+  halted = false;
+
+  if (running) {
+    write_dmcontrol(0);
+    space_dmcontrol();
   }
 }
 
@@ -180,9 +296,14 @@ uint32_t dtm_t::run_abstract_command(uint32_t command,
   assert(program_n <= ram_words);
   assert(data_n    <= data_words);
   
+  // only upload the words that differ from what the buffer already holds
   for (size_t i = 0; i < program_n; i++) {
+    if (i < progbuf_valid && progbuf[i] == program[i])
+      continue;
     write(DMI_PROGBUF0 + i, program[i]);
+    progbuf[i] = program[i];
   }
+  progbuf_valid = std::max(progbuf_valid, program_n);
 
   if (get_field(command, AC_ACCESS_REGISTER_WRITE) &&
       get_field(command, AC_ACCESS_REGISTER_TRANSFER)) {
@@ -365,9 +486,15 @@ void dtm_t::die(uint32_t cmderr)
 
 void dtm_t::clear_chunk(uint64_t taddr, size_t len)
 {
-  uint32_t prog[ram_words];
-  uint32_t data[data_words];
-  
+  // Without room for a store loop, fall back to system bus access.  The
+  // loop is preferred otherwise: its DMI cost doesn't grow with len.
+  if (ram_words < 4) {
+    clear_chunk_sba(taddr, len);
+    return;
+  }
+
+  uint32_t data[2];
+
   halt(current_hart);
   uint64_t s0 = save_reg(S0);
   uint64_t s1 = save_reg(S1);
@@ -383,25 +510,113 @@ void dtm_t::clear_chunk(uint64_t taddr, size_t len)
     AC_AR_REGNO(S0);
   RUN_AC_OR_DIE(command, 0, 0, data, xlen/(4*8));
 
-  // S1 = Addr + len, loop until S0 = S1
-  prog[0] = STORE(xlen, X0, S0, 0);
-  prog[1] = ADDI(S0, S0, xlen/8);
-  prog[2] = BNE(S0, S1, 0*4, 2*4);
-  prog[3] = EBREAK;
+  // Fill the program buffer with stores, leaving room for the ADDI, BNE
+  // and EBREAK, and let a single-store loop mop up what's left over.
+  size_t word = xlen / 8;
+  size_t stride = (ram_words - 3) * word;
+  size_t bulk = len - len % stride;
+  if (bulk)
+    clear_loop(taddr + bulk, stride);
+  if (bulk < len)
+    clear_loop(taddr + len, word);
 
-  data[0] = (uint32_t) (taddr + len);
-  data[1] = (uint32_t) ((taddr + len) >> 32);
-  command = AC_ACCESS_REGISTER_TRANSFER |
+  restore_reg(S0, s0);
+  restore_reg(S1, s1);
+
+  resume(current_hart);
+}
+
+// Zero from S0 up to end, storing stride bytes per loop iteration.
+void dtm_t::clear_loop(uint64_t end, size_t stride)
+{
+  uint32_t prog[ram_words];
+  uint32_t data[2];
+
+  // S1 = end, loop until S0 = S1
+  size_t n = 0;
+  for (size_t offset = 0; offset < stride; offset += xlen/8)
+    prog[n++] = STORE(xlen, X0, S0, offset);
+  prog[n] = ADDI(S0, S0, stride);
+  prog[n+1] = BNE(S0, S1, 0*4, (n+1)*4);
+  prog[n+2] = EBREAK;
+
+  data[0] = (uint32_t) end;
+  data[1] = (uint32_t) (end >> 32);
+  uint32_t command = AC_ACCESS_REGISTER_TRANSFER |
     AC_ACCESS_REGISTER_WRITE |
     AC_AR_SIZE(xlen) |
     AC_AR_REGNO(S1)  |
     AC_ACCESS_REGISTER_POSTEXEC;
-  RUN_AC_OR_DIE(command, prog, 4, data, xlen/(4*8));
+  RUN_AC_OR_DIE(command, prog, n+3, data, xlen/(4*8));
+}
 
-  restore_reg(S0, s0);
-  restore_reg(S1, s1);
+// Zero memory over system bus access: one autoincrementing write per word.
+// This debug spec has no sbbusy bit; a write that finds the bus busy is
+// dropped and reported as SBERROR 4.  So check sbcs after each batch and,
+// on a busy error, resume from wherever sbaddress got to, in smaller batches.
+void dtm_t::clear_chunk_sba(uint64_t taddr, size_t len)
+{
+  uint32_t sbcs = read(DMI_SBCS);
+  uint32_t sbaccess = xlen == 64 ? DMI_SBCS_SBACCESS64 : DMI_SBCS_SBACCESS32;
+  if (get_field(sbcs, DMI_SBCS_SBASIZE) == 0 || !(sbcs & sbaccess))
+    throw std::runtime_error("FESVR DTM needs a larger program buffer or system bus access to clear memory");
+
+  bool wide = get_field(sbcs, DMI_SBCS_SBASIZE) > 32;
+  uint32_t config = set_field(DMI_SBCS_SBAUTOINCREMENT, DMI_SBCS_SBACCESS,
+                              xlen == 64 ? 3 : 2);
+  uint64_t start = taddr, end = taddr + len, progress = taddr;
+  size_t word = xlen/8, batch = SBA_BATCH;
+  unsigned stalls = 0;
+  bool set_address = true;
+
+  write(DMI_SBCS, config);
+  // sbdata1 holds its value; each write of sbdata0 starts the next store
+  if (xlen == 64)
+    write(DMI_SBDATA1, 0);
+
+  while (true) {
+    if (set_address) {
+      if (wide)
+        write(DMI_SBADDRESS1, (uint32_t) (taddr >> 32));
+      write(DMI_SBADDRESS0, (uint32_t) taddr);
+      set_address = false;
+    }
 
-  resume(current_hart);
+    size_t n = std::min<uint64_t>(batch, (end - taddr) / word);
+    for (size_t i = 0; i < n; i++)
+      write(DMI_SBDATA0, 0);
+    taddr += n * word;
+
+    uint32_t error = get_field(read(DMI_SBCS), DMI_SBCS_SBERROR);
+    if (error == 0 && taddr < end)
+      continue;
+    if (error) {
+      write(DMI_SBCS, config | DMI_SBCS_SBERROR);
+      if (error != SBERROR_BUSY)
+        throw std::runtime_error("FESVR DTM system bus error while clearing memory");
+    }
+
+    // sbaddress only advances once a store completes, so everything below
+    // it is cleared; storing zero again above it is harmless
+    uint64_t done = read(DMI_SBADDRESS0);
+    if (wide)
+      done |= (uint64_t) read(DMI_SBADDRESS1) << 32;
+    if (!error && done >= end && get_field(read(DMI_SBCS), DMI_SBCS_SBERROR) == 0)
+      return;
+
+    if (done > progress) {
+      progress = done;
+      stalls = 0;
+    } else if (++stalls > SBA_MAX_STALLS) {
+      throw std::runtime_error("FESVR DTM system bus stayed busy while clearing memory");
+    }
+
+    if (error) {
+      taddr = std::min(std::max(done, start), end);
+      set_address = true;
+      batch = std::max<size_t>(batch / 2, 1);
+    }
+  }
 }
 
 uint64_t dtm_t::write_csr(unsigned which, uint64_t data)
@@ -427,7 +642,56 @@ uint64_t dtm_t::read_csr(unsigned which)
 uint64_t dtm_t::modify_csr(unsigned which, uint64_t data, uint32_t type)
 {
   halt(current_hart);
+  uint64_t res = modify_csr_halted(which, data, type);
+  resume(current_hart);
+  return res;
+}
+
+uint64_t dtm_t::modify_csr_halted(unsigned which, uint64_t data, uint32_t type)
+{
+  uint64_t old;
+  if (abstract_csrs && access_csr(which, &old, false)) {
+    uint64_t val = type == WRITE ? data : type == SET ? old | data : old & ~data;
+    // plain reads come in as set_csr(which, 0), and need no write back
+    if (val == old && type != WRITE)
+      return old;
+    if (access_csr(which, &val, true))
+      return old;
+  }
+
+  return modify_csr_progbuf(which, data, type);
+}
+
+// Access a CSR directly with an abstract Access Register command.  Returns
+// false if the command failed; if the debug module does not support it at
+// all, later accesses go straight to the program buffer.
+bool dtm_t::access_csr(unsigned which, uint64_t* value, bool is_write)
+{
+  uint32_t data[] = {(uint32_t) *value,
+                     (uint32_t) (*value >> 32)};
+
+  uint32_t command = AC_ACCESS_REGISTER_TRANSFER |
+    AC_AR_SIZE(xlen) |
+    AC_AR_CSR(which);
+  if (is_write)
+    command |= AC_ACCESS_REGISTER_WRITE;
+
+  uint32_t cmderr = run_abstract_command(command, 0, 0, data, xlen/(4*8));
+  if (cmderr) {
+    write(DMI_ABSTRACTCS, DMI_ABSTRACTCS_CMDERR);
+    if (cmderr == CMDERR_NOTSUP)
+      abstract_csrs = false;
+    return false;
+  }
+
+  *value = data[0];
+  if (xlen == 64)
+    *value |= ((uint64_t) data[1]) << 32;
+  return true;
+}
 
+uint64_t dtm_t::modify_csr_progbuf(unsigned which, uint64_t data, uint32_t type)
+{
   // This code just uses DSCRATCH to save S0
   // and data_base to do the transfer so we don't
   // need to run more commands to save and restore
@@ -461,7 +725,6 @@ uint64_t dtm_t::modify_csr(unsigned which, uint64_t data, uint32_t type)
   if (xlen == 64)
     res |= read(DMI_DATA0 + 1);//((uint64_t) adata[1]) << 32;
   
-  resume(current_hart);
   return res;  
 }
 
@@ -508,7 +771,12 @@ uint32_t dtm_t::get_xlen()
 void dtm_t::fence_i()
 {
   halt(current_hart);
+  fence_i_halted();
+  resume(current_hart);
+}
 
+void dtm_t::fence_i_halted()
+{
   const uint32_t prog[] = {
     FENCE_I,
     EBREAK
@@ -522,9 +790,6 @@ void dtm_t::fence_i()
     AC_AR_REGNO(X0);
 
   RUN_AC_OR_DIE(command, prog, sizeof(prog)/sizeof(*prog), 0, 0);
-  
-  resume(current_hart);
-
 }
 
 void host_thread_main(void* arg)
@@ -532,14 +797,39 @@ void host_thread_main(void* arg)
   ((dtm_t*)arg)->producer_thread();
 }
 
+void* dtm_t::host_pthread_main(void* arg)
+{
+  try {
+    ((dtm_t*)arg)->producer_thread();
+  } catch (host_stopped_t&) {
+  }
+  return NULL;
+}
+
 void dtm_t::reset()
 {
-  for (int hartsel = 0; hartsel < num_harts; hartsel ++ ){
-    select_hart(hartsel);
-    // this command also does a halt and resume
-    fence_i();
-    // after this command, the hart will run from _start.
-    write_csr(0x7b1, get_entry_point());
+  if (num_harts > 1 && select_all_harts()) {
+    // Halt every hart at once, point each at the entry point, then
+    // release them together, rather than halting and resuming each hart
+    // around every operation.
+    halt_all_harts();
+    for (int hartsel = 0; hartsel < num_harts; hartsel ++ ){
+      write_dmcontrol(set_field(DMI_DMCONTROL_DMACTIVE | DMI_DMCONTROL_HASEL,
+                                DMI_DMCONTROL_HARTSEL, hartsel));
+      current_hart = hartsel;
+      fence_i_halted();
+      modify_csr_halted(0x7b1, get_entry_point(), WRITE);
+    }
+    resume_all_harts();
+  } else {
+    for (int hartsel = 0; hartsel < num_harts; hartsel ++ ){
+      select_hart(hartsel);
+      // this command also does a halt and resume
+      fence_i();
+      // after this command, the hart will run from _start.
+      write_csr(0x7b1, get_entry_point());
+    }
+    release_hart();
   }
   // In theory any hart can handle the memory accesses,
   // this will enforce that hart 0 handles them.
@@ -549,6 +839,8 @@ void dtm_t::reset()
 
 void dtm_t::idle()
 {
+  // let the target run while we wait
+  release_hart();
   for (int idle_cycles = 0; idle_cycles < max_idle_cycles; idle_cycles++)
     nop();
 }
@@ -561,6 +853,7 @@ void dtm_t::producer_thread()
   // These are checked every time we run an abstract command.
   uint32_t abstractcs = read(DMI_ABSTRACTCS);
   ram_words = get_field(abstractcs, DMI_ABSTRACTCS_PROGSIZE);
+  progbuf.resize(ram_words);
   data_words = get_field(abstractcs, DMI_ABSTRACTCS_DATACOUNT);
 
   // These things are only needed for the 'modify_csr' function.
@@ -573,7 +866,7 @@ void dtm_t::producer_thread()
   data_base = get_field(hartinfo, DMI_HARTINFO_DATAADDR);
 
   // Enable the debugger.
-  write(DMI_DMCONTROL, DMI_DMCONTROL_DMACTIVE);
+  write_dmcontrol(DMI_DMCONTROL_DMACTIVE);
   
   num_harts = enumerate_harts();
   halt(0);
@@ -585,7 +878,10 @@ void dtm_t::producer_thread()
   running = true;
 
   htif_t::run();
+  release_hart();
 
+  // keep the simulator supplied with requests; a host thread is stopped
+  // from here by the destructor
   while (true)
     nop();
 }
@@ -595,19 +891,36 @@ void dtm_t::start_host_thread()
   req_wait = false;
   resp_wait = false;
 
+  if (host_is_threaded()) {
+    if (pthread_create(&producer, NULL, host_pthread_main, this) != 0)
+      abort();
+    // like the coroutine, have the first request ready before returning
+    while (!req_queue.pop(req_buf))
+      sched_yield();
+    req_wait = true;
+    return;
+  }
+
   target = context_t::current();
-  host.init(host_thread_main, this);
+  host.init(host_thread_main, this, get_host_stack_size());
   host.switch_to();
 }
 
 dtm_t::dtm_t(int argc, char** argv)
-  : htif_t(argc, argv), running(false)
+  : htif_t(argc, argv), stop_host(false), running(false), dmcontrol(0),
+    halted(false), dmi_spacing(dtm_needs_spacing()), abstract_csrs(true),
+    progbuf_valid(0), xlen(0)
 {
   start_host_thread();
 }
 
 dtm_t::~dtm_t()
 {
+  if (host_is_threaded()) {
+    // the host thread notices this the next time it waits on the target
+    stop_host = true;
+    pthread_join(producer, NULL);
+  }
 }
 
 void dtm_t::tick(
@@ -617,7 +930,8 @@ void dtm_t::tick(
 {
   if (!resp_wait) {
     if (!req_wait) {
-      req_wait = true;
+      if (!host_is_threaded() || req_queue.pop(req_buf))
+        req_wait = true;
     } else if (req_ready) {
       req_wait = false;
       resp_wait = true;
@@ -628,6 +942,11 @@ void dtm_t::tick(
     assert(resp_wait);
     resp_wait = false;
 
+    if (host_is_threaded()) {
+      resp_queue.push(resp_bits);
+      return;
+    }
+
     resp_buf = resp_bits;
     // update the target with the current context
     target = context_t::current();
@@ -636,6 +955,13 @@ void dtm_t::tick(
 }
 
 void dtm_t::return_resp(resp resp_bits){
+  if (host_is_threaded()) {
+    resp_queue.push(resp_bits);
+    while (!req_queue.pop(req_buf))
+      sched_yield();
+    return;
+  }
+
   resp_buf = resp_bits;
   target = context_t::current();
   host.switch_to();
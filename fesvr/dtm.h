@@ -3,7 +3,9 @@
 
 #include "htif.h"
 #include "context.h"
+#include "spsc_queue.h"
 #include <stdint.h>
+#include <atomic>
 #include <queue>
 #include <semaphore.h>
 #include <vector>
@@ -67,7 +69,15 @@ class dtm_t : public htif_t
  private:
   context_t host;
   context_t* target;
+  // with +host-thread, producer_thread() runs here and exchanges requests
+  // and responses with tick() through the queues below
   pthread_t producer;
+  spsc_queue_t<req, 4> req_queue;
+  spsc_queue_t<resp, 4> resp_queue;
+  std::atomic<bool> stop_host;
+  struct host_stopped_t {};
+  void wait_for_target();
+  static void* host_pthread_main(void* arg);
   sem_t req_produce;
   sem_t req_consume;
   sem_t resp_produce;
@@ -84,10 +94,32 @@ class dtm_t : public htif_t
   int enumerate_harts();
   void select_hart(int);
   void resume(int);
+  void release_hart();
+  void write_dmcontrol(uint32_t value);
+  void space_dmcontrol();
+  bool select_all_harts();
+  void halt_all_harts();
+  void resume_all_harts();
+  void fence_i_halted();
+  void clear_loop(uint64_t end, size_t stride);
+  void clear_chunk_sba(uint64_t taddr, size_t len);
   uint64_t save_reg(unsigned regno);
   void restore_reg(unsigned regno, uint64_t val);
   
   uint64_t modify_csr(unsigned which, uint64_t data, uint32_t type);
+  uint64_t modify_csr_halted(unsigned which, uint64_t data, uint32_t type);
+  uint64_t modify_csr_progbuf(unsigned which, uint64_t data, uint32_t type);
+  bool access_csr(unsigned which, uint64_t* value, bool is_write);
+
+  uint32_t dmcontrol; // last value written, less the one-shot requests
+  bool halted; // whether halt() has left current_hart halted
+  bool dmi_spacing;
+  bool abstract_csrs; // cleared once the DM rejects CSR regnos
+
+  // what the debug module's program buffer holds: the first progbuf_valid
+  // words of progbuf are known to match it
+  std::vector<uint32_t> progbuf;
+  size_t progbuf_valid;
 
   bool req_wait;
   bool resp_wait;
@@ -2,15 +2,17 @@
 
 #include "htif.h"
 #include "rfb.h"
+#include "context.h"
 #include "elfloader.h"
 #include "encoding.h"
 #include <algorithm>
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
 #include <vector>
 #include <queue>
 #include <iostream>
 #include <fstream>
-#include <iomanip>
 #include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
@@ -42,7 +44,9 @@ static void handle_signal(int sig)
 htif_t::htif_t()
   : mem(this), entry(DRAM_BASE), sig_addr(0), sig_len(0),
     tohost_addr(0), fromhost_addr(0), exitcode(0), stopped(false),
-    syscall_proxy(this)
+    syscall_proxy(this), rfb_fps(rfb_t::DEFAULT_FPS),
+    host_stack_size(context_t::DEFAULT_STACK_SIZE), threaded_host(false),
+    dmi_spacing(false)
 {
   signal(SIGINT, &handle_signal);
   signal(SIGTERM, &handle_signal);
@@ -100,15 +104,25 @@ void htif_t::load_program()
         " (did you misspell it? If VCS, did you forget +permissive/+permissive-off?)");
 
   // temporarily construct a memory interface that skips writing bytes
-  // that have already been preloaded through a sideband
+  // that have already been preloaded through a sideband, and offers the
+  // rest to the backdoor loader before the front-end transport
   class preload_aware_memif_t : public memif_t {
    public:
     preload_aware_memif_t(htif_t* htif) : memif_t(htif), htif(htif) {}
 
     void write(addr_t taddr, size_t len, const void* src) override
     {
-      if (!htif->is_address_preloaded(taddr, len))
-        memif_t::write(taddr, len, src);
+      if (htif->is_address_preloaded(taddr, len))
+        return;
+
+      if (htif->backdoor_loader && len) {
+        const char* bytes = (const char*)src;
+        bool zero = std::all_of(bytes, bytes + len, [](char c) { return c == 0; });
+        if (htif->backdoor_loader(taddr, len, zero ? NULL : src))
+          return;
+      }
+
+      memif_t::write(taddr, len, src);
     }
 
    private:
@@ -135,36 +149,69 @@ void htif_t::load_program()
 void htif_t::stop()
 {
   if (!sig_file.empty() && sig_len) // print final torture test signature
-  {
-    std::vector<uint8_t> buf(sig_len);
-    mem.read(sig_addr, sig_len, &buf[0]);
+    dump_signature();
+
+  stopped = true;
+}
+
+// Write the signature as 16-byte lines, most significant byte first,
+// reading target memory a chunk at a time and formatting it into a large
+// buffer so the file is written in a few big pieces.
+void htif_t::dump_signature()
+{
+  static const char hex[] = "0123456789abcdef";
+  const addr_t incr = 16;
+  assert(sig_len % incr == 0);
 
-    std::ofstream sigs(sig_file);
-    assert(sigs && "can't open signature file!");
-    sigs << std::setfill('0') << std::hex;
+  std::ofstream sigs(sig_file, std::ios::binary);
+  if (!sigs)
+    throw std::runtime_error("can't open signature file " + sig_file);
 
-    const addr_t incr = 16;
-    assert(sig_len % incr == 0);
-    for (addr_t i = 0; i < sig_len; i += incr)
+  size_t block = std::max<size_t>(chunk_max_size() / incr * incr, incr);
+  std::vector<uint8_t> buf(std::min<addr_t>(block, sig_len));
+  const size_t line = 2 * incr + 1;
+  std::vector<char> out((1 << 16) / line * line);
+  size_t n = 0;
+
+  for (addr_t pos = 0; pos < sig_len; pos += block)
+  {
+    size_t len = std::min<addr_t>(block, sig_len - pos);
+    mem.read(sig_addr + pos, len, &buf[0]);
+
+    for (size_t i = 0; i < len; i += incr)
     {
-      for (addr_t j = incr; j > 0; j--)
-        sigs << std::setw(2) << (uint16_t)buf[i+j-1];
-      sigs << '\n';
-    }
+      char* p = &out[n];
+      for (size_t j = incr; j > 0; j--)
+      {
+        uint8_t b = buf[i+j-1];
+        *p++ = hex[b >> 4];
+        *p++ = hex[b & 0xf];
+      }
+      *p = '\n';
 
-    sigs.close();
+      n += line;
+      if (n == out.size())
+      {
+        sigs.write(&out[0], n);
+        n = 0;
+      }
+    }
   }
 
-  stopped = true;
+  sigs.write(&out[0], n);
+  if (!sigs.flush())
+    throw std::runtime_error("can't write signature file " + sig_file);
 }
 
 void htif_t::clear_chunk(addr_t taddr, size_t len)
 {
-  char zeros[chunk_max_size()];
-  memset(zeros, 0, chunk_max_size());
+  size_t max_chunk = chunk_max_size();
+  // zero-filled on growth and never written, so it is allocated only once
+  if (zeros.size() < max_chunk)
+    zeros.resize(max_chunk);
 
-  for (size_t pos = 0; pos < len; pos += chunk_max_size())
-    write_chunk(taddr + pos, std::min(len - pos, chunk_max_size()), zeros);
+  for (size_t pos = 0; pos < len; pos += max_chunk)
+    write_chunk(taddr + pos, std::min(len - pos, max_chunk), zeros.data());
 }
 
 int htif_t::run()
@@ -228,8 +275,7 @@ void htif_t::parse_arguments(int argc, char ** argv)
       case 'h': usage(argv[0]);
         throw std::invalid_argument("User quered htif_t help text");
       case HTIF_LONG_OPTIONS_OPTIND:
-        if (optarg) dynamic_devices.push_back(new rfb_t(atoi(optarg)));
-        else        dynamic_devices.push_back(new rfb_t);
+        rfb_displays.push_back(optarg ? atoi(optarg) : 0);
         break;
       case HTIF_LONG_OPTIONS_OPTIND + 1:
         // [TODO] Remove once disks are supported again
@@ -242,6 +288,33 @@ void htif_t::parse_arguments(int argc, char ** argv)
       case HTIF_LONG_OPTIONS_OPTIND + 3:
         syscall_proxy.set_chroot(optarg);
         break;
+      case HTIF_LONG_OPTIONS_OPTIND + 4:
+        syscall_proxy.set_file_cache(true);
+        break;
+      case HTIF_LONG_OPTIONS_OPTIND + 5:
+        rfb_fps = atoi(optarg);
+        break;
+      case HTIF_LONG_OPTIONS_OPTIND + 6: {
+        // anything smaller is mostly guard page and overflows on first use
+        char* end;
+        errno = 0;
+        unsigned long long size = strtoull(optarg, &end, 0);
+        if (!isdigit((unsigned char)optarg[0]) || *end || errno ||
+            size < context_t::MIN_STACK_SIZE || size > (1ULL << 32)) {
+          usage(argv[0]);
+          throw std::invalid_argument("--host-stack/+host-stack must be a byte count between " +
+                                      std::to_string(context_t::MIN_STACK_SIZE) + " and 4 GiB");
+        }
+        size_t page = sysconf(_SC_PAGESIZE);
+        host_stack_size = (size + page - 1) / page * page;
+        break;
+      }
+      case HTIF_LONG_OPTIONS_OPTIND + 7:
+        threaded_host = true;
+        break;
+      case HTIF_LONG_OPTIONS_OPTIND + 8:
+        dmi_spacing = true;
+        break;
       case '?':
         if (!opterr)
           break;
@@ -256,6 +329,10 @@ void htif_t::parse_arguments(int argc, char ** argv)
           c = HTIF_LONG_OPTIONS_OPTIND;
           optarg = optarg + 5;
         }
+        else if (arg.find("+rfb-fps=") == 0) {
+          c = HTIF_LONG_OPTIONS_OPTIND + 5;
+          optarg = optarg + 9;
+        }
         else if (arg.find("+disk=") == 0) {
           c = HTIF_LONG_OPTIONS_OPTIND + 1;
           optarg = optarg + 6;
@@ -268,6 +345,22 @@ void htif_t::parse_arguments(int argc, char ** argv)
           c = HTIF_LONG_OPTIONS_OPTIND + 3;
           optarg = optarg + 8;
         }
+        else if (arg == "+file-cache") {
+          c = HTIF_LONG_OPTIONS_OPTIND + 4;
+          optarg = nullptr;
+        }
+        else if (arg.find("+host-stack=") == 0) {
+          c = HTIF_LONG_OPTIONS_OPTIND + 6;
+          optarg = optarg + 12;
+        }
+        else if (arg == "+host-thread") {
+          c = HTIF_LONG_OPTIONS_OPTIND + 7;
+          optarg = nullptr;
+        }
+        else if (arg == "+dmi-spacing") {
+          c = HTIF_LONG_OPTIONS_OPTIND + 8;
+          optarg = nullptr;
+        }
         else if (arg.find("+permissive-off") == 0) {
           if (opterr)
             throw std::invalid_argument("Found +permissive-off when not parsing permissively");
@@ -304,6 +397,10 @@ done_processing:
 
 void htif_t::register_devices()
 {
+  // created here so that --rfb-fps applies regardless of argument order
+  for (auto display : rfb_displays)
+    dynamic_devices.push_back(new rfb_t(display, rfb_fps));
+
   device_list.register_device(&syscall_proxy);
   device_list.register_device(&bcd);
   for (auto d : dynamic_devices)
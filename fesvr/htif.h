@@ -7,6 +7,8 @@
 #include "syscall.h"
 #include "device.h"
 #include <string.h>
+#include <atomic>
+#include <functional>
 #include <vector>
 
 class htif_t : public chunked_memif_t
@@ -26,6 +28,14 @@ class htif_t : public chunked_memif_t
 
   virtual memif_t& memif() { return mem; }
 
+  // Backdoor loading: a simulator that can place data in target memory
+  // directly (e.g. into a Verilator memory array) registers a loader here.
+  // The initial program load hands it each PT_LOAD segment, with src NULL
+  // for ranges that are to be zero-filled.  Returning false falls back to
+  // writing that range through the front-end transport.
+  typedef std::function<bool(addr_t taddr, size_t len, const void* src)> backdoor_loader_t;
+  void set_backdoor_loader(backdoor_loader_t loader) { backdoor_loader = loader; }
+
  protected:
   virtual void reset() = 0;
 
@@ -43,6 +53,13 @@ class htif_t : public chunked_memif_t
 
   reg_t get_entry_point() { return entry; }
 
+  // stack size for the host-side coroutine of context-switching front ends
+  size_t get_host_stack_size() { return host_stack_size; }
+  // whether such front ends should run the host on its own OS thread
+  bool host_is_threaded() { return threaded_host; }
+  // whether the DTM must pace DMCONTROL writes and halt around each access
+  bool dtm_needs_spacing() { return dmi_spacing; }
+
   // indicates that the initial program load can skip writing this address
   // range to memory, because it has already been loaded through a sideband
   virtual bool is_address_preloaded(addr_t taddr, size_t len) { return false; }
@@ -51,8 +68,10 @@ class htif_t : public chunked_memif_t
   void parse_arguments(int argc, char ** argv);
   void register_devices();
   void usage(const char * program_name);
+  void dump_signature();
 
   memif_t mem;
+  backdoor_loader_t backdoor_loader;
   reg_t entry;
   bool writezeros;
   std::vector<std::string> hargs;
@@ -62,13 +81,20 @@ class htif_t : public chunked_memif_t
   addr_t sig_len; // torture
   addr_t tohost_addr;
   addr_t fromhost_addr;
-  int exitcode;
-  bool stopped;
+  // written on the host thread, read by done() and exit_code() elsewhere
+  std::atomic<int> exitcode;
+  std::atomic<bool> stopped;
 
   device_list_t device_list;
   syscall_t syscall_proxy;
   bcd_t bcd;
   std::vector<device_t*> dynamic_devices;
+  std::vector<char> zeros; // source for the default clear_chunk
+  std::vector<int> rfb_displays;
+  unsigned rfb_fps;
+  size_t host_stack_size;
+  bool threaded_host;
+  bool dmi_spacing;
 
   const std::vector<std::string>& target_args() { return targs; }
 
@@ -89,10 +115,20 @@ class htif_t : public chunked_memif_t
                              +permissive (Only needed for VCS)\n\
       --rfb=DISPLAY        Add new remote frame buffer on display DISPLAY\n\
        +rfb=DISPLAY          to be accessible on 5900 + DISPLAY (default = 0)\n\
+      --rfb-fps=FPS        Scan remote frame buffers at most FPS times per\n\
+       +rfb-fps=FPS          second (default = 30)\n\
       --signature=FILE     Write torture test signature to FILE\n\
        +signature=FILE\n\
       --chroot=PATH        Use PATH as location of syscall-servicing binaries\n\
        +chroot=PATH\n\
+      --file-cache         Serve reads of files opened read-only by the target\n\
+       +file-cache           from a cached in-memory copy\n\
+      --host-stack=BYTES   Size the host-side coroutine stack at BYTES\n\
+       +host-stack=BYTES     (default = 65536, minimum = 16384)\n\
+      --host-thread        Run the host on its own thread rather than as a\n\
+       +host-thread          coroutine of the simulator (TSI and DTM only)\n\
+      --dmi-spacing        Halt and resume the hart around every DTM access\n\
+       +dmi-spacing          and never issue back-to-back DMCONTROL writes\n\
 \n\
 HOST OPTIONS (currently unsupported)\n\
       --disk=DISK          Add DISK device. Use a ramdisk since this isn't\n\
@@ -109,6 +145,11 @@ TARGET (RISC-V BINARY) OPTIONS\n\
 {"disk",      required_argument, 0, HTIF_LONG_OPTIONS_OPTIND + 1 },     \
 {"signature", required_argument, 0, HTIF_LONG_OPTIONS_OPTIND + 2 },     \
 {"chroot",    required_argument, 0, HTIF_LONG_OPTIONS_OPTIND + 3 },     \
+{"file-cache", no_argument,      0, HTIF_LONG_OPTIONS_OPTIND + 4 },     \
+{"rfb-fps",   required_argument, 0, HTIF_LONG_OPTIONS_OPTIND + 5 },     \
+{"host-stack", required_argument, 0, HTIF_LONG_OPTIONS_OPTIND + 6 },     \
+{"host-thread", no_argument,     0, HTIF_LONG_OPTIONS_OPTIND + 7 },     \
+{"dmi-spacing", no_argument,     0, HTIF_LONG_OPTIONS_OPTIND + 8 },     \
 {0, 0, 0, 0}
 
 #endif // __HTIF_H
@@ -1,12 +1,24 @@
 // See LICENSE for license details.
 
 #include <iostream>
+#include <algorithm>
 #include <assert.h>
+#include <string.h>
 #include "htif_hexwriter.h"
 
 htif_hexwriter_t::htif_hexwriter_t(size_t b, size_t w, size_t d)
-  : base(b), width(w), depth(d)
+  : base(b), width(w), depth(d), page_size(std::max<size_t>(w, 4096))
 {
+  // a page holds a whole number of lines
+  assert(page_size % width == 0);
+  pages.resize((width*depth + page_size - 1) / page_size);
+}
+
+char* htif_hexwriter_t::page(size_t idx)
+{
+  if(pages[idx].empty())
+    pages[idx].resize(page_size, 0);
+  return &pages[idx][0];
 }
 
 void htif_hexwriter_t::read_chunk(addr_t taddr, size_t len, void* vdst)
@@ -20,15 +32,17 @@ void htif_hexwriter_t::read_chunk(addr_t taddr, size_t len, void* vdst)
   uint8_t* dst = (uint8_t*)vdst;
   while(len)
   {
-    if(mem[taddr/width].size() == 0)
-      mem[taddr/width].resize(width,0);
-
-    for(size_t j = 0; j < width; j++)
-      dst[j] = mem[taddr/width][j];
+    size_t offset = taddr % page_size;
+    size_t n = std::min(len, page_size - offset);
+    const std::vector<char>& p = pages[taddr / page_size];
+    if(p.empty())
+      memset(dst, 0, n);
+    else
+      memcpy(dst, &p[offset], n);
 
-    len -= width;
-    taddr += width;
-    dst += width;
+    len -= n;
+    taddr += n;
+    dst += n;
   }
 }
 
@@ -43,34 +57,88 @@ void htif_hexwriter_t::write_chunk(addr_t taddr, size_t len, const void* vsrc)
   const uint8_t* src = (const uint8_t*)vsrc;
   while(len)
   {
-    if(mem[taddr/width].size() == 0)
-      mem[taddr/width].resize(width,0);
+    size_t offset = taddr % page_size;
+    size_t n = std::min(len, page_size - offset);
+    memcpy(page(taddr / page_size) + offset, src, n);
 
-    for(size_t j = 0; j < width; j++)
-      mem[taddr/width][j] = src[j];
-
-    len -= width;
-    taddr += width;
+    len -= n;
+    taddr += n;
+    src += n;
   }
 }
 
-std::ostream& operator<< (std::ostream& o, const htif_hexwriter_t& h)
+void htif_hexwriter_t::write_chunk_masked(addr_t taddr, size_t len, const void* vsrc, uint64_t byte_mask)
 {
-  std::ios_base::fmtflags flags = o.setf(std::ios::hex,std::ios::basefield);
+  taddr -= base;
+
+  assert(len == width);
+  assert(taddr < width*depth);
 
-  for(size_t addr = 0; addr < h.depth; addr++)
+  const uint8_t* src = (const uint8_t*)vsrc;
+  char* dst = page(taddr / page_size) + taddr % page_size;
+
+  for(size_t j = 0; j < width; j++)
+    if(byte_mask & (uint64_t(1) << j))
+      dst[j] = src[j];
+}
+
+std::ostream& operator<< (std::ostream& o, const htif_hexwriter_t& h)
+{
+  static const char hex[] = "0123456789abcdef";
+
+  // lines are formatted into buf and written out when it fills up;
+  // runs of pages that were never written come from a block of zero lines
+  const size_t line = 2*h.width + 1;
+  const size_t block_lines = std::max<size_t>((1 << 16) / line, 1);
+  std::vector<char> buf(block_lines * line);
+  std::vector<char> zeros(block_lines * line, '0');
+  for (size_t j = line-1; j < zeros.size(); j += line)
+    zeros[j] = '\n';
+
+  size_t n = 0;
+  const size_t page_lines = h.page_size / h.width;
+  for(size_t addr = 0; addr < h.depth; )
   {
-    std::map<addr_t,std::vector<char> >::const_iterator i = h.mem.find(addr);
-    if(i == h.mem.end())
-      for(size_t j = 0; j < h.width; j++)
-        o << "00";
-    else
+    const std::vector<char>& page = h.pages[addr / page_lines];
+    size_t next = std::min(addr + page_lines, h.depth);
+
+    if(page.empty())
+    {
+      o.write(&buf[0], n);
+      n = 0;
+      // extend the run over any following pages that were never written
+      while(next < h.depth && h.pages[next / page_lines].empty())
+        next = std::min(next + page_lines, h.depth);
+      for(size_t run = (next - addr) * line; run; )
+      {
+        size_t len = std::min(run, zeros.size());
+        o.write(&zeros[0], len);
+        run -= len;
+      }
+      addr = next;
+      continue;
+    }
+
+    for(const char* l = &page[0]; addr < next; addr++, l += h.width)
+    {
+      char* p = &buf[n];
       for(size_t j = 0; j < h.width; j++)
-        o << ((i->second[h.width-j-1] >> 4) & 0xF) << (i->second[h.width-j-1] & 0xF);
-    o << std::endl;
+      {
+        uint8_t b = l[h.width-j-1];
+        *p++ = hex[b >> 4];
+        *p++ = hex[b & 0xF];
+      }
+      *p = '\n';
+
+      n += line;
+      if(n == buf.size())
+      {
+        o.write(&buf[0], n);
+        n = 0;
+      }
+    }
   }
-
-  o.setf(flags);
+  o.write(&buf[0], n);
 
   return o;
 }
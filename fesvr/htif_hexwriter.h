@@ -3,7 +3,6 @@
 #ifndef __HTIF_HEXWRITER_H
 #define __HTIF_HEXWRITER_H
 
-#include <map>
 #include <vector>
 #include <stdlib.h>
 #include "memif.h"
@@ -17,10 +16,15 @@ protected:
   size_t base;
   size_t width;
   size_t depth;
-  std::map<addr_t,std::vector<char> > mem;
+  // memory is kept in pages of page_size bytes, allocated on first write;
+  // pages that were never written read back as zero
+  size_t page_size;
+  std::vector<std::vector<char> > pages;
+  char* page(size_t idx);
 
   void read_chunk(addr_t taddr, size_t len, void* dst);
   void write_chunk(addr_t taddr, size_t len, const void* src);
+  void write_chunk_masked(addr_t taddr, size_t len, const void* src, uint64_t byte_mask);
   void clear_chunk(addr_t taddr, size_t len) {}
 
   size_t chunk_max_size() { return width; }
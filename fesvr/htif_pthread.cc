@@ -3,6 +3,49 @@
 #include "htif_pthread.h"
 #include <algorithm>
 #include <stdio.h>
+#include <string.h>
+
+void byte_ring_t::reserve(size_t capacity)
+{
+  if (capacity <= buf.size())
+    return;
+
+  // grow geometrically and unwrap the contents to the front
+  std::vector<char> bigger(std::max(capacity, 2 * buf.size()));
+  if (len) {
+    size_t first = std::min(len, buf.size() - head);
+    memcpy(bigger.data(), buf.data() + head, first);
+    memcpy(bigger.data() + first, buf.data(), len - first);
+  }
+  buf.swap(bigger);
+  head = 0;
+}
+
+void byte_ring_t::push(const void* src, size_t n)
+{
+  if (n == 0)
+    return;
+
+  reserve(len + n);
+  size_t tail = (head + len) % buf.size();
+  size_t first = std::min(n, buf.size() - tail);
+  memcpy(buf.data() + tail, src, first);
+  memcpy(buf.data(), (const char*)src + first, n - first);
+  len += n;
+}
+
+void byte_ring_t::pop(void* dst, size_t n)
+{
+  if (n == 0)
+    return;
+
+  size_t first = std::min(n, buf.size() - head);
+  memcpy(dst, buf.data() + head, first);
+  memcpy((char*)dst + first, buf.data(), n - first);
+  len -= n;
+  // restart at the front when drained, so later transfers stay contiguous
+  head = len ? (head + n) % buf.size() : 0;
+}
 
 void htif_pthread_t::thread_main(void* arg)
 {
@@ -13,10 +56,10 @@ void htif_pthread_t::thread_main(void* arg)
 }
 
 htif_pthread_t::htif_pthread_t(int argc, char** argv)
-    : htif_t(argc, argv)
+    : htif_t(argc, argv), th_data(4096), ht_data(4096)
 {
   target = context_t::current();
-  host.init(thread_main, this);
+  host.init(thread_main, this, get_host_stack_size());
 }
 
 htif_pthread_t::~htif_pthread_t()
@@ -29,21 +72,20 @@ ssize_t htif_pthread_t::read(void* buf, size_t max_size)
     target->switch_to();
 
   size_t s = std::min(max_size, th_data.size());
-  std::copy(th_data.begin(), th_data.begin() + s, (char*)buf);
-  th_data.erase(th_data.begin(), th_data.begin() + s);
+  th_data.pop(buf, s);
 
   return s;
 }
 
 ssize_t htif_pthread_t::write(const void* buf, size_t size)
 {
-  ht_data.insert(ht_data.end(), (const char*)buf, (const char*)buf + size);
+  ht_data.push(buf, size);
   return size;
 }
 
 void htif_pthread_t::send(const void* buf, size_t size)
 {
-  th_data.insert(th_data.end(), (const char*)buf, (const char*)buf + size);
+  th_data.push(buf, size);
 }
 
 void htif_pthread_t::recv(void* buf, size_t size)
@@ -60,7 +102,6 @@ bool htif_pthread_t::recv_nonblocking(void* buf, size_t size)
     return false;
   }
 
-  std::copy(ht_data.begin(), ht_data.begin() + size, (char*)buf);
-  ht_data.erase(ht_data.begin(), ht_data.begin() + size);
+  ht_data.pop(buf, size);
   return true;
 }
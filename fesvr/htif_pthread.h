@@ -5,7 +5,23 @@
 
 #include "htif.h"
 #include "context.h"
-#include <deque>
+#include <vector>
+
+// growable circular byte queue with bulk push/pop
+class byte_ring_t
+{
+ public:
+  byte_ring_t(size_t capacity = 0) : head(0), len(0) { reserve(capacity); }
+  size_t size() const { return len; }
+  void reserve(size_t capacity);
+  void push(const void* src, size_t n);
+  void pop(void* dst, size_t n);
+
+ private:
+  std::vector<char> buf;
+  size_t head;
+  size_t len;
+};
 
 class htif_pthread_t : public htif_t
 {
@@ -29,8 +45,8 @@ class htif_pthread_t : public htif_t
  private:
   context_t host;
   context_t* target;
-  std::deque<char> th_data;
-  std::deque<char> ht_data;
+  byte_ring_t th_data;
+  byte_ring_t ht_data;
 
   static void thread_main(void* htif);
 };
@@ -8,11 +8,11 @@
 
 void memif_t::read(addr_t addr, size_t len, void* bytes)
 {
-  size_t align = cmemif->chunk_align();
+  size_t align = chunk_align();
   if (len && (addr & (align-1)))
   {
     size_t this_len = std::min(len, align - size_t(addr & (align-1)));
-    uint8_t chunk[align];
+    uint8_t* chunk = align_buf(align);
 
     cmemif->read_chunk(addr & ~(align-1), align, chunk);
     memcpy(bytes, chunk + (addr & (align-1)), this_len);
@@ -26,7 +26,7 @@ void memif_t::read(addr_t addr, size_t len, void* bytes)
   {
     size_t this_len = len & (align-1);
     size_t start = len - this_len;
-    uint8_t chunk[align];
+    uint8_t* chunk = align_buf(align);
 
     cmemif->read_chunk(addr + start, align, chunk);
     memcpy((char*)bytes + start, chunk, this_len);
@@ -35,21 +35,18 @@ void memif_t::read(addr_t addr, size_t len, void* bytes)
   }
 
   // now we're aligned
-  for (size_t pos = 0; pos < len; pos += cmemif->chunk_max_size())
-    cmemif->read_chunk(addr + pos, std::min(cmemif->chunk_max_size(), len - pos), (char*)bytes + pos);
+  size_t max_chunk = chunk_max_size();
+  for (size_t pos = 0; pos < len; pos += max_chunk)
+    cmemif->read_chunk(addr + pos, std::min(max_chunk, len - pos), (char*)bytes + pos);
 }
 
 void memif_t::write(addr_t addr, size_t len, const void* bytes)
 {
-  size_t align = cmemif->chunk_align();
+  size_t align = chunk_align();
   if (len && (addr & (align-1)))
   {
     size_t this_len = std::min(len, align - size_t(addr & (align-1)));
-    uint8_t chunk[align];
-
-    cmemif->read_chunk(addr & ~(align-1), align, chunk);
-    memcpy(chunk + (addr & (align-1)), bytes, this_len);
-    cmemif->write_chunk(addr & ~(align-1), align, chunk);
+    write_partial(addr & ~(align-1), align, addr & (align-1), this_len, bytes);
 
     bytes = (char*)bytes + this_len;
     addr += this_len;
@@ -60,11 +57,7 @@ void memif_t::write(addr_t addr, size_t len, const void* bytes)
   {
     size_t this_len = len & (align-1);
     size_t start = len - this_len;
-    uint8_t chunk[align];
-
-    cmemif->read_chunk(addr + start, align, chunk);
-    memcpy(chunk, (char*)bytes + start, this_len);
-    cmemif->write_chunk(addr + start, align, chunk);
+    write_partial(addr + start, align, 0, this_len, (char*)bytes + start);
 
     len -= this_len;
   }
@@ -77,107 +70,153 @@ void memif_t::write(addr_t addr, size_t len, const void* bytes)
   if (all_zero) {
     cmemif->clear_chunk(addr, len);
   } else {
-    size_t max_chunk = cmemif->chunk_max_size();
+    size_t max_chunk = chunk_max_size();
     for (size_t pos = 0; pos < len; pos += max_chunk)
       cmemif->write_chunk(addr + pos, std::min(max_chunk, len - pos), (char*)bytes + pos);
   }
 }
 
-#define MEMIF_READ_FUNC \
-  if(addr & (sizeof(val)-1)) \
-    throw std::runtime_error("misaligned address"); \
-  this->read(addr, sizeof(val), &val); \
-  return val
+void chunked_memif_t::write_chunk_masked(addr_t taddr, size_t len, const void* src,
+                                         uint64_t byte_mask)
+{
+  uint8_t chunk[MAX_MASKED_CHUNK];
+
+  read_chunk(taddr, len, chunk);
+  for (size_t i = 0; i < len; i++)
+    if (byte_mask & (uint64_t(1) << i))
+      chunk[i] = ((const uint8_t*)src)[i];
+  write_chunk(taddr, len, chunk);
+}
+
+// write len bytes at offset within the aligned chunk at chunk_addr
+void memif_t::write_partial(addr_t chunk_addr, size_t align, size_t offset,
+                            size_t len, const void* bytes)
+{
+  uint8_t* chunk = align_buf(align);
+
+  if (align <= chunked_memif_t::MAX_MASKED_CHUNK) {
+    uint64_t mask = (len == 64 ? ~uint64_t(0) : (uint64_t(1) << len) - 1) << offset;
+    memcpy(chunk + offset, bytes, len);
+    cmemif->write_chunk_masked(chunk_addr, align, chunk, mask);
+  } else {
+    cmemif->read_chunk(chunk_addr, align, chunk);
+    memcpy(chunk + offset, bytes, len);
+    cmemif->write_chunk(chunk_addr, align, chunk);
+  }
+}
+
+// Length of the run of iovecs starting at iov[i] whose target ranges abut,
+// and which can therefore move as one transfer; count is set to their number.
+static size_t contiguous_run(const memif_iovec_t* iov, size_t iovcnt, size_t i, size_t& count)
+{
+  size_t len = iov[i].len;
+  for (count = 1; i + count < iovcnt; count++)
+  {
+    if (iov[i + count].len && iov[i + count].base != iov[i].base + len)
+      break;
+    len += iov[i + count].len;
+  }
+  return len;
+}
+
+void memif_t::readv(const memif_iovec_t* iov, size_t iovcnt, void* bytes)
+{
+  for (size_t i = 0, n; i < iovcnt; i += n)
+  {
+    size_t len = contiguous_run(iov, iovcnt, i, n);
+    if (len)
+      read(iov[i].base, len, bytes);
+    bytes = (char*)bytes + len;
+  }
+}
 
-#define MEMIF_WRITE_FUNC \
-  if(addr & (sizeof(val)-1)) \
-    throw std::runtime_error("misaligned address"); \
-  this->write(addr, sizeof(val), &val)
+void memif_t::writev(const memif_iovec_t* iov, size_t iovcnt, const void* bytes)
+{
+  for (size_t i = 0, n; i < iovcnt; i += n)
+  {
+    size_t len = contiguous_run(iov, iovcnt, i, n);
+    if (len)
+      write(iov[i].base, len, bytes);
+    bytes = (const char*)bytes + len;
+  }
+}
 
 uint8_t memif_t::read_uint8(addr_t addr)
 {
-  uint8_t val;
-  MEMIF_READ_FUNC;
+  return read_scalar<uint8_t>(addr);
 }
 
 int8_t memif_t::read_int8(addr_t addr)
 {
-  int8_t val;
-  MEMIF_READ_FUNC;
+  return read_scalar<int8_t>(addr);
 }
 
 void memif_t::write_uint8(addr_t addr, uint8_t val)
 {
-  MEMIF_WRITE_FUNC;
+  write_scalar(addr, val);
 }
 
 void memif_t::write_int8(addr_t addr, int8_t val)
 {
-  MEMIF_WRITE_FUNC;
+  write_scalar(addr, val);
 }
 
 uint16_t memif_t::read_uint16(addr_t addr)
 {
-  uint16_t val;
-  MEMIF_READ_FUNC;
+  return read_scalar<uint16_t>(addr);
 }
 
 int16_t memif_t::read_int16(addr_t addr)
 {
-  int16_t val;
-  MEMIF_READ_FUNC;
+  return read_scalar<int16_t>(addr);
 }
 
 void memif_t::write_uint16(addr_t addr, uint16_t val)
 {
-  MEMIF_WRITE_FUNC;
+  write_scalar(addr, val);
 }
 
 void memif_t::write_int16(addr_t addr, int16_t val)
 {
-  MEMIF_WRITE_FUNC;
+  write_scalar(addr, val);
 }
 
 uint32_t memif_t::read_uint32(addr_t addr)
 {
-  uint32_t val;
-  MEMIF_READ_FUNC;
+  return read_scalar<uint32_t>(addr);
 }
 
 int32_t memif_t::read_int32(addr_t addr)
 {
-  int32_t val;
-  MEMIF_READ_FUNC;
+  return read_scalar<int32_t>(addr);
 }
 
 void memif_t::write_uint32(addr_t addr, uint32_t val)
 {
-  MEMIF_WRITE_FUNC;
+  write_scalar(addr, val);
 }
 
 void memif_t::write_int32(addr_t addr, int32_t val)
 {
-  MEMIF_WRITE_FUNC;
+  write_scalar(addr, val);
 }
 
 uint64_t memif_t::read_uint64(addr_t addr)
 {
-  uint64_t val;
-  MEMIF_READ_FUNC;
+  return read_scalar<uint64_t>(addr);
 }
 
 int64_t memif_t::read_int64(addr_t addr)
 {
-  int64_t val;
-  MEMIF_READ_FUNC;
+  return read_scalar<int64_t>(addr);
 }
 
 void memif_t::write_uint64(addr_t addr, uint64_t val)
 {
-  MEMIF_WRITE_FUNC;
+  write_scalar(addr, val);
 }
 
 void memif_t::write_int64(addr_t addr, int64_t val)
 {
-  MEMIF_WRITE_FUNC;
+  write_scalar(addr, val);
 }
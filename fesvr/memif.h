@@ -5,11 +5,20 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdexcept>
+#include <vector>
 
 typedef uint64_t reg_t;
 typedef int64_t sreg_t;
 typedef reg_t addr_t;
 
+// a contiguous range of target memory, used for scatter/gather transfers
+struct memif_iovec_t
+{
+  addr_t base;
+  size_t len;
+};
+
 class chunked_memif_t
 {
 public:
@@ -17,20 +26,34 @@ public:
   virtual void write_chunk(addr_t taddr, size_t len, const void* src) = 0;
   virtual void clear_chunk(addr_t taddr, size_t len) = 0;
 
+  // Write only the bytes of an aligned chunk whose bit is set in byte_mask
+  // (bit i covers src[i]).  Only used when chunk_align() <= MAX_MASKED_CHUNK.
+  // The default does a read-modify-write; backends whose buses have byte
+  // strobes should override it to write in a single transaction.
+  virtual void write_chunk_masked(addr_t taddr, size_t len, const void* src,
+                                  uint64_t byte_mask);
+
   virtual size_t chunk_align() = 0;
   virtual size_t chunk_max_size() = 0;
+
+  static const size_t MAX_MASKED_CHUNK = 64;
 };
 
 class memif_t
 {
 public:
-  memif_t(chunked_memif_t* _cmemif) : cmemif(_cmemif) {}
+  memif_t(chunked_memif_t* _cmemif)
+    : cmemif(_cmemif), cached_align(0), cached_max_size(0) {}
   virtual ~memif_t(){}
 
   // read and write byte arrays
   virtual void read(addr_t addr, size_t len, void* bytes);
   virtual void write(addr_t addr, size_t len, const void* bytes);
 
+  // gather target ranges into, or scatter them from, one contiguous buffer
+  virtual void readv(const memif_iovec_t* iov, size_t iovcnt, void* bytes);
+  virtual void writev(const memif_iovec_t* iov, size_t iovcnt, const void* bytes);
+
   // read and write 8-bit words
   virtual uint8_t read_uint8(addr_t addr);
   virtual int8_t read_int8(addr_t addr);
@@ -55,8 +78,65 @@ public:
   virtual void write_uint64(addr_t addr, uint64_t val);
   virtual void write_int64(addr_t addr, int64_t val);
 
+  // naturally aligned scalars; values spanning whole chunks go straight to
+  // the backend, bypassing the head/tail handling of read() and write()
+  template <typename T>
+  T read_scalar(addr_t addr)
+  {
+    T val;
+    if (addr & (sizeof(T)-1))
+      throw std::runtime_error("misaligned address");
+    if (sizeof(T) >= chunk_align() && sizeof(T) <= chunk_max_size())
+      cmemif->read_chunk(addr, sizeof(T), &val);
+    else
+      this->read(addr, sizeof(T), &val);
+    return val;
+  }
+
+  template <typename T>
+  void write_scalar(addr_t addr, T val)
+  {
+    if (addr & (sizeof(T)-1))
+      throw std::runtime_error("misaligned address");
+    if (sizeof(T) >= chunk_align() && sizeof(T) <= chunk_max_size())
+      cmemif->write_chunk(addr, sizeof(T), &val);
+    else
+      this->write(addr, sizeof(T), &val);
+  }
+
 protected:
   chunked_memif_t* cmemif;
+
+  // The backend's geometry, queried once rather than through a virtual
+  // call per access.  A zero is not cached, since some backends (e.g. the
+  // DTM) only learn their alignment after probing the target.
+  size_t chunk_align()
+  {
+    if (!cached_align)
+      cached_align = cmemif->chunk_align();
+    return cached_align;
+  }
+  size_t chunk_max_size()
+  {
+    if (!cached_max_size)
+      cached_max_size = cmemif->chunk_max_size();
+    return cached_max_size;
+  }
+
+private:
+  void write_partial(addr_t chunk_addr, size_t align, size_t offset,
+                     size_t len, const void* bytes);
+
+  // scratch chunk for unaligned heads and tails, grown to chunk_align()
+  uint8_t* align_buf(size_t align)
+  {
+    if (align_chunk.size() < align)
+      align_chunk.resize(align);
+    return align_chunk.data();
+  }
+  std::vector<uint8_t> align_chunk;
+  size_t cached_align;
+  size_t cached_max_size;
 };
 
 #endif // __MEMIF_H
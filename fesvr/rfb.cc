@@ -1,8 +1,11 @@
+#include "config.h"
 #include "rfb.h"
 #include "memif.h"
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sched.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <cstdlib>
@@ -10,14 +13,20 @@
 #include <string>
 #include <cstring>
 #include <cinttypes>
+#include <algorithm>
+#ifdef HAVE_LIBZ
+# include <zlib.h>
+#endif
 using namespace std::placeholders;
 
-rfb_t::rfb_t(int display)
-  : sockfd(-1), afd(-1),
+rfb_t::rfb_t(int display, unsigned fps)
+  : sockfd(-1),
     memif(0), addr(0), width(0), height(0), bpp(0), display(display),
-    thread(pthread_self()), fb1(0), fb2(0), read_pos(0),
-    lock(PTHREAD_MUTEX_INITIALIZER)
+    thread(pthread_self()), fb1(0), fb2(0), fb3(0), frame_ready(false), read_pos(0),
+    lock(PTHREAD_MUTEX_INITIALIZER),
+    fps(fps ? fps : DEFAULT_FPS), tick_interval(0), stopping(false)
 {
+  wake_fd[0] = wake_fd[1] = -1;
   register_command(0, std::bind(&rfb_t::handle_configure, this, _1), "configure");
   register_command(1, std::bind(&rfb_t::handle_set_address, this, _1), "set_address");
 }
@@ -30,115 +39,590 @@ void* rfb_thread_main(void* arg)
 
 void rfb_t::thread_main()
 {
-  pthread_mutex_lock(&lock);
-
   int port = 5900 + display;
   sockfd = socket(PF_INET, SOCK_STREAM, 0);
   if (sockfd < 0)
     throw std::runtime_error("could not acquire tcp socket");
 
-  struct sockaddr_in saddr, caddr;
+  int one = 1;
+  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in saddr;
   saddr.sin_family = AF_INET;
   saddr.sin_addr.s_addr = INADDR_ANY;
   saddr.sin_port = htons(port);
   if (bind(sockfd, (struct sockaddr*)&saddr, sizeof(saddr)) < 0)
     throw std::runtime_error("could not bind to port " + std::to_string(port));
-  if (listen(sockfd, 0) < 0)
+  if (listen(sockfd, SOMAXCONN) < 0)
     throw std::runtime_error("could not listen on port " + std::to_string(port));
- 
-  socklen_t clen = sizeof(caddr);
-  afd = accept(sockfd, (struct sockaddr*)&caddr, &clen);
-  if (afd < 0)
-    throw std::runtime_error("could not accept connection");
-
-  std::string version = "RFB 003.003\n";
-  write(version);
-  if (read() != version)
-    throw std::runtime_error("bad client version");
+  if (fcntl(sockfd, F_SETFL, O_NONBLOCK) < 0)
+    throw std::runtime_error("could not make socket non-blocking");
+
+  // All sockets are non-blocking and serviced from one poll loop, which is
+  // also woken when tick() completes a frame.  A viewer is only sent a new
+  // update once its previous one has drained, so a slow viewer just skips
+  // intermediate frames instead of stalling the others or the device.
+  std::vector<struct pollfd> fds;
+  std::vector<bool> frame_changed;
+  while (!stopping)
+  {
+    fds.clear();
+    fds.push_back({wake_fd[0], POLLIN, 0});
+    fds.push_back({sockfd, POLLIN, 0});
+    for (auto& c : clients)
+      fds.push_back({c.fd, short(POLLIN | (c.out.empty() ? 0 : POLLOUT)), 0});
 
-  write(str(uint32_t(htonl(1))));
+    if (poll(&fds[0], fds.size(), -1) < 0 && errno != EINTR)
+      throw std::runtime_error("could not poll");
 
-  read(); // clientinit
+    if (fds[0].revents & POLLIN)
+    {
+      char buf[64];
+      while (::read(wake_fd[0], buf, sizeof(buf)) > 0)
+        ;
+    }
 
-  std::string serverinit;
-  serverinit += str(uint16_t(htons(width)));
-  serverinit += str(uint16_t(htons(height)));
-  serverinit += pixel_format();
-  std::string name = "RISC-V";
-  serverinit += str(uint32_t(htonl(name.length())));
-  serverinit += name;
-  write(serverinit);
+    if (fds[1].revents & POLLIN)
+      accept_clients();
 
-  pthread_mutex_unlock(&lock);
+    size_t i = 2;
+    for (auto it = clients.begin(); it != clients.end(); i++)
+    {
+      short revents = i < fds.size() && fds[i].fd == it->fd ? fds[i].revents : 0;
+      bool ok = true;
+      if (revents & (POLLIN | POLLHUP | POLLERR))
+        ok = read_client(*it);
+      if (ok && (revents & POLLOUT))
+        ok = flush_client(*it);
+
+      if (ok)
+        it++;
+      else
+      {
+        close_client(*it);
+        it = clients.erase(it);
+      }
+    }
 
-  while (memif == NULL)
-    sched_yield();
+    // Take the latest frame and the tiles it changed, then encode from it
+    // without holding the lock, so tick() never has to drop a frame because
+    // encoding is slow.
+    pthread_mutex_lock(&lock);
+    if (frame_ready)
+    {
+      std::swap(fb1, fb3);
+      frame_ready = false;
+    }
+    frame_changed = changed;
+    changed.assign(changed.size(), false);
+    pthread_mutex_unlock(&lock);
 
-  while (memif != NULL)
-  {
-    std::string s = read();
-    if (s.length() < 4)
-      break; //throw std::runtime_error("bad command");
+    for (auto& c : clients)
+    {
+      for (size_t t = 0; t < frame_changed.size(); t++)
+        if (frame_changed[t])
+          c.dirty[t] = true;
+      if (c.state == client_t::NORMAL && c.update_requested && c.out.empty())
+        fb_update(c);
+    }
 
-    switch (s[0])
+    for (auto it = clients.begin(); it != clients.end(); )
     {
-      case 0: set_pixel_format(s); break;
-      case 2: set_encodings(s); break;
-      case 3: break;
+      if (flush_client(*it))
+        it++;
+      else
+      {
+        close_client(*it);
+        it = clients.erase(it);
+      }
     }
   }
 
-  pthread_mutex_lock(&lock);
-  close(afd);
+  for (auto& c : clients)
+    close_client(c);
+  clients.clear();
   close(sockfd);
-  afd = -1;
   sockfd = -1;
-  pthread_mutex_unlock(&lock);
-
-  thread_main();
 }
 
 rfb_t::~rfb_t()
 {
   memif = 0;
   if (!pthread_equal(pthread_self(), thread))
+  {
+    stopping = true;
+    char c = 0;
+    if (::write(wake_fd[1], &c, 1) < 0 && errno != EAGAIN)
+      abort();
     pthread_join(thread, 0);
+  }
   delete [] fb1;
   delete [] fb2;
+  delete [] fb3;
+  if (wake_fd[0] >= 0)
+  {
+    close(wake_fd[0]);
+    close(wake_fd[1]);
+  }
+}
+
+void rfb_t::accept_clients()
+{
+  int fd;
+  while ((fd = accept(sockfd, NULL, NULL)) >= 0)
+  {
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+    {
+      close(fd);
+      continue;
+    }
+
+    client_t c;
+    c.state = client_t::VERSION;
+    c.fd = fd;
+    c.out = "RFB 003.003\n";
+    c.out_pos = 0;
+    c.dirty.assign(tiles_x() * tiles_y(), true);
+    c.update_requested = false;
+    c.full_update_requested = false;
+    c.req_tx0 = c.req_ty0 = c.req_tx1 = c.req_ty1 = 0;
+    c.encoding = ENCODING_RAW;
+    c.zrle_stream = NULL;
+#ifdef HAVE_LIBZ
+    // each connection gets its own zlib stream, as ZRLE requires
+    c.zrle_stream = new z_stream_s();
+    if (deflateInit(c.zrle_stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+      throw std::runtime_error("could not initialize zlib");
+#endif
+    clients.push_back(c);
+  }
+}
+
+void rfb_t::close_client(client_t& c)
+{
+  close(c.fd);
+#ifdef HAVE_LIBZ
+  deflateEnd(c.zrle_stream);
+  delete c.zrle_stream;
+#endif
+}
+
+bool rfb_t::flush_client(client_t& c)
+{
+  // send from an offset and only compact once drained, so a slow viewer
+  // doesn't cost a copy of the rest of a large update per partial write
+  while (c.out_pos < c.out.size())
+  {
+    ssize_t n = ::write(c.fd, c.out.data() + c.out_pos, c.out.size() - c.out_pos);
+    if (n < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    c.out_pos += n;
+  }
+  c.out.clear();
+  c.out_pos = 0;
+  return true;
+}
+
+bool rfb_t::read_client(client_t& c)
+{
+  char buf[4096];
+  ssize_t n = ::read(c.fd, buf, sizeof(buf));
+  if (n == 0)
+    return false;
+  if (n < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  c.in.append(buf, n);
+
+  // consume every complete message; their lengths depend on their type
+  while (true)
+  {
+    size_t len = 0;
+    if (c.state == client_t::VERSION)
+      len = 12;
+    else if (c.state == client_t::CLIENT_INIT)
+      len = 1;
+    else if (!c.in.empty())
+    {
+      switch (c.in[0])
+      {
+        case 0: len = 20; break;
+        case 2: len = c.in.size() < 4 ? 4 : 4 + 4 * ntohs(*(uint16_t*)&c.in[2]); break;
+        case 3: len = 10; break;
+        case 4: len = 8; break;
+        case 5: len = 6; break;
+        case 6: len = c.in.size() < 8 ? 8 : 8 + ntohl(*(uint32_t*)&c.in[4]); break;
+        default: return false;
+      }
+    }
+
+    if (len == 0 || len > MAX_MESSAGE_SIZE || c.in.size() < len)
+      return len <= MAX_MESSAGE_SIZE;
+
+    std::string s = c.in.substr(0, len);
+    c.in.erase(0, len);
+    if (!handle_message(c, s))
+      return false;
+  }
+}
+
+bool rfb_t::handle_message(client_t& c, const std::string& s)
+{
+  switch (c.state)
+  {
+    case client_t::VERSION:
+      if (s != "RFB 003.003\n")
+        return false;
+      c.out += str(uint32_t(htonl(1)));
+      c.state = client_t::CLIENT_INIT;
+      return true;
+    case client_t::CLIENT_INIT:
+    {
+      std::string serverinit;
+      serverinit += str(uint16_t(htons(width)));
+      serverinit += str(uint16_t(htons(height)));
+      serverinit += pixel_format();
+      serverinit += str(uint32_t(htonl(name().length())));
+      serverinit += name();
+      c.out += serverinit;
+      c.state = client_t::NORMAL;
+      return true;
+    }
+    default:
+      switch (s[0])
+      {
+        case 0: return set_pixel_format(s);
+        case 2: set_encodings(c, s); break;
+        case 3: update_request(c, s); break;
+      }
+      return true;
+  }
+}
+
+void rfb_t::set_encodings(client_t& c, const std::string& s)
+{
+  // use the first encoding in the client's preference order we support
+  uint16_t n = ntohs(*(uint16_t*)&s[2]);
+  for (size_t i = 0; i < n && 4 + 4*i + 4 <= s.length(); i++)
+  {
+    int32_t e = ntohl(*(uint32_t*)&s[4 + 4*i]);
+#ifdef HAVE_LIBZ
+    if (e == ENCODING_ZRLE)
+    {
+      c.encoding = e;
+      return;
+    }
+#endif
+    if (e == ENCODING_HEXTILE || e == ENCODING_RAW)
+    {
+      c.encoding = e;
+      return;
+    }
+  }
+  c.encoding = ENCODING_RAW;
 }
 
-void rfb_t::set_encodings(const std::string& s)
+bool rfb_t::set_pixel_format(const std::string& s)
 {
-  uint16_t n = htons(*(uint16_t*)&s[2]);
-  for (size_t b = s.length(); b < 4U+4U*n; b += read().length());
+  return s.length() == 20 && s.substr(4, 16) == pixel_format();
 }
 
-void rfb_t::set_pixel_format(const std::string& s)
+void rfb_t::update_request(client_t& c, const std::string& s)
 {
-  if (s.length() != 20 || s.substr(4, 16) != pixel_format())
-    throw std::runtime_error("bad pixel format");
+  // requests received before the update is sent cover their union
+  size_t x = ntohs(*(uint16_t*)&s[2]), y = ntohs(*(uint16_t*)&s[4]);
+  size_t w = ntohs(*(uint16_t*)&s[6]), h = ntohs(*(uint16_t*)&s[8]);
+  size_t tx0 = std::min(x / TILE_SIZE, tiles_x());
+  size_t ty0 = std::min(y / TILE_SIZE, tiles_y());
+  size_t tx1 = std::min((x + w + TILE_SIZE - 1) / TILE_SIZE, tiles_x());
+  size_t ty1 = std::min((y + h + TILE_SIZE - 1) / TILE_SIZE, tiles_y());
+  if (tx0 >= tx1 || ty0 >= ty1)
+    return;
+
+  if (c.update_requested)
+  {
+    tx0 = std::min(tx0, c.req_tx0);
+    ty0 = std::min(ty0, c.req_ty0);
+    tx1 = std::max(tx1, c.req_tx1);
+    ty1 = std::max(ty1, c.req_ty1);
+  }
+  c.req_tx0 = tx0;
+  c.req_ty0 = ty0;
+  c.req_tx1 = tx1;
+  c.req_ty1 = ty1;
+  c.update_requested = true;
+  c.full_update_requested |= s[1] == 0;
 }
 
-void rfb_t::fb_update(const std::string& s)
+void rfb_t::find_dirty_tiles()
 {
-  std::string u;
-  u += str(uint8_t(0));
-  u += str(uint8_t(0));
-  u += str(uint16_t(htons(1)));
-  u += str(uint16_t(htons(0)));
-  u += str(uint16_t(htons(0)));
-  u += str(uint16_t(htons(width)));
-  u += str(uint16_t(htons(height)));
-  u += str(uint32_t(htonl(0)));
-  u += std::string((char*)fb1, fb_bytes());
+  // compare the frame just read (fb2) against the previous one (fb1, or
+  // fb3 once the rfb thread has taken it) a tile row at a time; memcmp is
+  // vectorized by the C library
+  const char* cur = const_cast<const char*>(fb2);
+  const char* prev = const_cast<const char*>(frame_ready ? fb1 : fb3);
+  size_t stride = size_t(width) * bpp/8;
+
+  for (size_t ty = 0; ty < tiles_y(); ty++)
+  {
+    size_t y1 = std::min<size_t>((ty + 1) * TILE_SIZE, height);
+    for (size_t tx = 0; tx < tiles_x(); tx++)
+    {
+      if (changed[ty * tiles_x() + tx])
+        continue;
+      size_t off = tx * TILE_SIZE * bpp/8;
+      size_t len = (std::min<size_t>((tx + 1) * TILE_SIZE, width) - tx * TILE_SIZE) * bpp/8;
+      for (size_t y = ty * TILE_SIZE; y < y1; y++)
+      {
+        if (memcmp(cur + y * stride + off, prev + y * stride + off, len) != 0)
+        {
+          changed[ty * tiles_x() + tx] = true;
+          break;
+        }
+      }
+    }
+  }
+}
+
+void rfb_t::fb_update(client_t& c)
+{
+  // only the requested tiles are sent; the rest stay dirty for later
+  if (c.full_update_requested)
+    for (size_t ty = c.req_ty0; ty < c.req_ty1; ty++)
+      for (size_t tx = c.req_tx0; tx < c.req_tx1; tx++)
+        c.dirty[ty * tiles_x() + tx] = true;
+
+  // send each horizontal run of dirty tiles as one rectangle
+  std::string rects;
+  uint16_t nrects = 0;
+
+  for (size_t ty = c.req_ty0; ty < c.req_ty1; ty++)
+  {
+    for (size_t tx = c.req_tx0; tx < c.req_tx1; )
+    {
+      if (!c.dirty[ty * tiles_x() + tx])
+      {
+        tx++;
+        continue;
+      }
+
+      size_t run = 1;
+      while (tx + run < c.req_tx1 && c.dirty[ty * tiles_x() + tx + run])
+        run++;
+
+      uint16_t x = tx * TILE_SIZE, y = ty * TILE_SIZE;
+      uint16_t w = std::min<size_t>((tx + run) * TILE_SIZE, width) - x;
+      uint16_t h = std::min<size_t>((ty + 1) * TILE_SIZE, height) - y;
+      rects += str(uint16_t(htons(x)));
+      rects += str(uint16_t(htons(y)));
+      rects += str(uint16_t(htons(w)));
+      rects += str(uint16_t(htons(h)));
+      rects += str(uint32_t(htonl(c.encoding)));
+      switch (c.encoding)
+      {
+        case ENCODING_HEXTILE: encode_hextile(rects, x, y, w, h); break;
+        case ENCODING_ZRLE: encode_zrle(c, rects, x, y, w, h); break;
+        default: encode_raw(rects, x, y, w, h); break;
+      }
+      nrects++;
+
+      for (size_t i = 0; i < run; i++)
+        c.dirty[ty * tiles_x() + tx + i] = false;
+      tx += run;
+    }
+  }
+
+  // an incremental request with no changes stays pending until one occurs
+  if (nrects == 0)
+    return;
+
+  c.out += str(uint8_t(0));
+  c.out += str(uint8_t(0));
+  c.out += str(uint16_t(htons(nrects)));
+  c.out += rects;
+
+  c.update_requested = false;
+  c.full_update_requested = false;
+}
+
+void rfb_t::encode_raw(std::string& out, size_t x, size_t y, size_t w, size_t h)
+{
+  for (size_t row = y; row < y + h; row++)
+    out.append(const_cast<const char*>(fb3) + (row * width + x) * bpp/8, w * bpp/8);
+}
+
+void rfb_t::encode_hextile(std::string& out, size_t x, size_t y, size_t w, size_t h)
+{
+  enum { RAW = 1, BACKGROUND = 2, ANY_SUBRECTS = 8, SUBRECTS_COLOURED = 16 };
+
+  // The background is the tile's first pixel; every horizontal run of
+  // other pixels becomes a coloured subrect.  Tiles where that would not
+  // beat Raw are sent Raw.
+  bool have_bg = false;
+  uint32_t bg = 0;
+  std::string subrects;
 
-  try
+  for (size_t ty = y; ty < y + h; ty += TILE_SIZE)
   {
-    write(u);
+    size_t th = std::min<size_t>(TILE_SIZE, y + h - ty);
+    for (size_t tx = x; tx < x + w; tx += TILE_SIZE)
+    {
+      size_t tw = std::min<size_t>(TILE_SIZE, x + w - tx);
+      uint32_t tile_bg = pixel(tx, ty);
+      size_t nsubrects = 0;
+      subrects.clear();
+
+      for (size_t j = 0; j < th && nsubrects <= 255; j++)
+      {
+        for (size_t i = 0; i < tw; )
+        {
+          uint32_t c = pixel(tx + i, ty + j);
+          size_t run = 1;
+          while (i + run < tw && pixel(tx + i + run, ty + j) == c)
+            run++;
+          if (c != tile_bg)
+          {
+            subrects += str(c);
+            subrects += str(uint8_t(i << 4 | j));
+            subrects += str(uint8_t((run - 1) << 4));
+            nsubrects++;
+          }
+          i += run;
+        }
+      }
+
+      bool new_bg = !have_bg || tile_bg != bg;
+      size_t size = 1 + (new_bg ? 4 : 0) + (nsubrects ? 1 + subrects.size() : 0);
+      if (nsubrects > 255 || size >= 1 + tw * th * bpp/8)
+      {
+        out += str(uint8_t(RAW));
+        encode_raw(out, tx, ty, tw, th);
+        have_bg = false; // the background is undefined after a Raw tile
+        continue;
+      }
+
+      uint8_t flags = (new_bg ? BACKGROUND : 0) | (nsubrects ? ANY_SUBRECTS | SUBRECTS_COLOURED : 0);
+      out += str(flags);
+      if (new_bg)
+        out += str(tile_bg);
+      if (nsubrects)
+      {
+        out += str(uint8_t(nsubrects));
+        out += subrects;
+      }
+      have_bg = true;
+      bg = tile_bg;
+    }
   }
-  catch (std::runtime_error& e)
+}
+
+void rfb_t::encode_zrle(client_t& c, std::string& out, size_t x, size_t y, size_t w, size_t h)
+{
+#ifdef HAVE_LIBZ
+  const size_t ZRLE_TILE_SIZE = 64;
+  const size_t CPIXEL_SIZE = 3; // 24-bit depth fits in 3 bytes
+
+  // Each tile is sent solid, as a packed palette of up to 16 colours, or
+  // raw.  All tiles of the rectangle are then deflated together on the
+  // connection's persistent zlib stream.
+  std::string data;
+  std::vector<uint32_t> palette;
+  std::vector<uint8_t> index;
+
+  for (size_t ty = y; ty < y + h; ty += ZRLE_TILE_SIZE)
   {
+    size_t th = std::min(ZRLE_TILE_SIZE, y + h - ty);
+    for (size_t tx = x; tx < x + w; tx += ZRLE_TILE_SIZE)
+    {
+      size_t tw = std::min(ZRLE_TILE_SIZE, x + w - tx);
+      palette.clear();
+      index.resize(tw * th);
+
+      for (size_t j = 0; j < th; j++)
+      {
+        for (size_t i = 0; i < tw; i++)
+        {
+          uint32_t c = pixel(tx + i, ty + j);
+          size_t k = std::find(palette.begin(), palette.end(), c) - palette.begin();
+          if (k == palette.size() && palette.size() <= 16)
+            palette.push_back(c);
+          index[j * tw + i] = k;
+        }
+        if (palette.size() > 16)
+          break;
+      }
+
+      if (palette.size() > 16)
+      {
+        data += str(uint8_t(0));
+        for (size_t j = 0; j < th; j++)
+          for (size_t i = 0; i < tw; i++)
+            data += str(pixel(tx + i, ty + j)).substr(0, CPIXEL_SIZE);
+        continue;
+      }
+
+      data += str(uint8_t(palette.size()));
+      for (auto c : palette)
+        data += str(c).substr(0, CPIXEL_SIZE);
+      if (palette.size() == 1)
+        continue;
+
+      size_t bits = palette.size() <= 2 ? 1 : palette.size() <= 4 ? 2 : 4;
+      for (size_t j = 0; j < th; j++)
+      {
+        uint8_t byte = 0;
+        size_t nbits = 0;
+        for (size_t i = 0; i < tw; i++)
+        {
+          byte = byte << bits | index[j * tw + i];
+          if ((nbits += bits) == 8)
+          {
+            data += str(byte);
+            byte = nbits = 0;
+          }
+        }
+        if (nbits)
+          data += str(uint8_t(byte << (8 - nbits)));
+      }
+    }
   }
+
+  std::string compressed;
+  char buf[65536];
+  c.zrle_stream->next_in = (Bytef*)&data[0];
+  c.zrle_stream->avail_in = data.size();
+  do {
+    c.zrle_stream->next_out = (Bytef*)buf;
+    c.zrle_stream->avail_out = sizeof(buf);
+    if (deflate(c.zrle_stream, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+      throw std::runtime_error("zlib error");
+    compressed.append(buf, sizeof(buf) - c.zrle_stream->avail_out);
+  } while (c.zrle_stream->avail_out == 0);
+
+  out += str(uint32_t(htonl(compressed.size())));
+  out += compressed;
+#else
+  throw std::runtime_error("ZRLE requires zlib");
+#endif
+}
+
+size_t rfb_t::scan_budget(clock_t::time_point now)
+{
+  // Spread what is left of the frame evenly over the ticks expected before
+  // its deadline.  A fast-spinning HTIF loop thus reads FB_ALIGN bytes per
+  // tick, while a loop busy with other memif traffic reads larger slices,
+  // up to MAX_SCAN.  The cap keeps one tick from stalling the HTIF loop on
+  // a slow transport; a frame that can't be read in time just finishes
+  // late, lowering the effective frame rate.
+  size_t left = fb_bytes() - read_pos;
+  double time_left = std::chrono::duration<double>(frame_deadline - now).count();
+  size_t budget = MAX_SCAN;
+  if (time_left > tick_interval)
+  {
+    budget = left / (time_left / std::max(tick_interval, 1e-9));
+    budget = (budget + FB_ALIGN - 1) / FB_ALIGN * FB_ALIGN;
+    budget = std::min<size_t>(std::max<size_t>(budget, FB_ALIGN), MAX_SCAN);
+  }
+  return std::min(budget, left);
 }
 
 void rfb_t::tick()
@@ -146,15 +630,40 @@ void rfb_t::tick()
   if (fb_bytes() == 0 || memif == NULL)
     return;
 
-  memif->read(addr + read_pos, FB_ALIGN, const_cast<char*>(fb2 + read_pos));
-  read_pos = (read_pos + FB_ALIGN) % fb_bytes();
+  clock_t::time_point now = clock_t::now();
+  if (last_tick != clock_t::time_point())
+  {
+    double interval = std::chrono::duration<double>(now - last_tick).count();
+    tick_interval = tick_interval ? (7 * tick_interval + interval) / 8 : interval;
+  }
+  last_tick = now;
+
+  // don't start scanning the next frame before the last one's deadline
   if (read_pos == 0)
   {
-    std::swap(fb1, fb2);
+    if (now < frame_deadline)
+      return;
+    frame_deadline = now + std::chrono::duration_cast<clock_t::duration>(
+      std::chrono::duration<double>(1.0 / fps));
+  }
+
+  size_t len = scan_budget(now);
+  memif->read(addr + read_pos, len, const_cast<char*>(fb2 + read_pos));
+  read_pos = (read_pos + len) % fb_bytes();
+  if (read_pos == 0)
+  {
+    // The rfb thread only holds the lock to take a frame, but don't wait
+    // for it; if it is busy, fb2 is simply overwritten by the next sweep.
     if (pthread_mutex_trylock(&lock) == 0)
     {
-      fb_update("");
+      find_dirty_tiles();
+      std::swap(fb1, fb2);
+      frame_ready = true;
       pthread_mutex_unlock(&lock);
+
+      char c = 0;
+      if (::write(wake_fd[1], &c, 1) < 0 && errno != EAGAIN)
+        throw std::runtime_error("could not wake rfb thread");
     }
   }
 }
@@ -181,23 +690,6 @@ std::string rfb_t::pixel_format()
   return fmt;
 }
 
-void rfb_t::write(const std::string& s)
-{
-  if ((size_t)::write(afd, s.c_str(), s.length()) != s.length())
-    throw std::runtime_error("could not write");
-}
-
-std::string rfb_t::read()
-{
-  char buf[2048];
-  ssize_t len = ::read(afd, buf, sizeof(buf));
-  if (len < 0)
-    throw std::runtime_error("could not read");
-  if (len == sizeof(buf))
-    throw std::runtime_error("received oversized packet");
-  return std::string(buf, len);
-}
-
 void rfb_t::handle_configure(command_t cmd)
 {
   if (fb1)
@@ -213,8 +705,16 @@ void rfb_t::handle_configure(command_t cmd)
   if (fb_bytes() % FB_ALIGN != 0)
     throw std::runtime_error("rfb size must be a multiple of " + std::to_string(FB_ALIGN));
 
-  fb1 = new char[fb_bytes()];
-  fb2 = new char[fb_bytes()];
+  fb1 = new char[fb_bytes()]();
+  fb2 = new char[fb_bytes()]();
+  fb3 = new char[fb_bytes()]();
+  changed.assign(tiles_x() * tiles_y(), false);
+
+  if (pipe(wake_fd) < 0
+      || fcntl(wake_fd[0], F_SETFL, O_NONBLOCK) < 0
+      || fcntl(wake_fd[1], F_SETFL, O_NONBLOCK) < 0)
+    throw std::runtime_error("could not create pipe");
+
   if (pthread_create(&thread, 0, rfb_thread_main, this))
     throw std::runtime_error("could not create thread");
   cmd.respond(1);
@@ -4,17 +4,24 @@
 #include "device.h"
 #include "memif.h"
 #include <pthread.h>
+#include <vector>
+#include <list>
+#include <chrono>
+
+struct z_stream_s;
 
 // remote frame buffer
 class rfb_t : public device_t
 {
  public:
-  rfb_t(int display = 0);
+  rfb_t(int display = 0, unsigned fps = DEFAULT_FPS);
   ~rfb_t();
   void tick();
   std::string name() { return "RISC-V"; }
   const char* identity() { return "rfb"; }
 
+  static const unsigned DEFAULT_FPS = 30;
+
  private:
   template <typename T>
   std::string str(T x)
@@ -22,19 +29,49 @@ class rfb_t : public device_t
     return std::string((char*)&x, sizeof(x));
   }
   size_t fb_bytes() { return size_t(width) * height * bpp/8; }
+  size_t tiles_x() { return (width + TILE_SIZE - 1) / TILE_SIZE; }
+  size_t tiles_y() { return (height + TILE_SIZE - 1) / TILE_SIZE; }
+
+  // per-viewer connection state, owned by the rfb thread
+  struct client_t
+  {
+    enum { VERSION, CLIENT_INIT, NORMAL } state;
+    int fd;
+    std::string in;
+    std::string out; // pending output, drained as the socket allows
+    size_t out_pos; // bytes of out already sent
+    std::vector<bool> dirty; // tiles this viewer has not yet been sent
+    bool update_requested;
+    bool full_update_requested;
+    size_t req_tx0, req_ty0, req_tx1, req_ty1; // requested tiles, half-open
+    int32_t encoding;
+    z_stream_s* zrle_stream; // only used when built with zlib
+  };
+
   void thread_main();
   friend void* rfb_thread_main(void*);
   std::string pixel_format();
-  void fb_update(const std::string& s);
-  void set_encodings(const std::string& s);
-  void set_pixel_format(const std::string& s);
-  void write(const std::string& s);
-  std::string read();
+  void find_dirty_tiles();
+  void fb_update(client_t& c);
+  uint32_t pixel(size_t x, size_t y)
+  {
+    return ((const uint32_t*)const_cast<const char*>(fb3))[y * width + x];
+  }
+  void encode_raw(std::string& out, size_t x, size_t y, size_t w, size_t h);
+  void encode_hextile(std::string& out, size_t x, size_t y, size_t w, size_t h);
+  void encode_zrle(client_t& c, std::string& out, size_t x, size_t y, size_t w, size_t h);
+  void accept_clients();
+  bool read_client(client_t& c);
+  bool flush_client(client_t& c);
+  void close_client(client_t& c);
+  bool handle_message(client_t& c, const std::string& s);
+  void set_encodings(client_t& c, const std::string& s);
+  bool set_pixel_format(const std::string& s);
+  void update_request(client_t& c, const std::string& s);
   void handle_configure(command_t cmd);
   void handle_set_address(command_t cmd);
 
   int sockfd;
-  int afd;
   memif_t* memif;
   reg_t addr;
   uint16_t width;
@@ -42,12 +79,37 @@ class rfb_t : public device_t
   uint16_t bpp;
   int display;
   pthread_t thread;
-  volatile char* volatile fb1;
-  volatile char* volatile fb2;
+  volatile char* volatile fb1; // latest complete frame
+  volatile char* volatile fb2; // frame being scanned by tick()
+  volatile char* volatile fb3; // frame being encoded by the rfb thread
+  bool frame_ready; // fb1 is newer than fb3
   size_t read_pos;
   pthread_mutex_t lock;
 
+  // framebuffer scan rate control
+  typedef std::chrono::steady_clock clock_t;
+  size_t scan_budget(clock_t::time_point now);
+  unsigned fps;
+  clock_t::time_point frame_deadline;
+  clock_t::time_point last_tick;
+  double tick_interval; // moving average, in seconds
+
+  // tiles changed by frames not yet handed to the viewers
+  std::vector<bool> changed;
+  std::list<client_t> clients;
+  volatile bool stopping;
+
+  // used to wake the rfb thread when tick() completes a frame
+  int wake_fd[2];
+
   static const int FB_ALIGN = 256;
+  static const int MAX_SCAN = 4096; // most framebuffer bytes read per tick
+  static const int TILE_SIZE = 16;
+  static const size_t MAX_MESSAGE_SIZE = 1 << 20;
+
+  static const int32_t ENCODING_RAW = 0;
+  static const int32_t ENCODING_HEXTILE = 5;
+  static const int32_t ENCODING_ZRLE = 16;
 };
 
 #endif
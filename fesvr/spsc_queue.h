@@ -0,0 +1,70 @@
+// See LICENSE for license details.
+
+#ifndef _SPSC_QUEUE_H
+#define _SPSC_QUEUE_H
+
+#include <atomic>
+#include <stddef.h>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread.  N must be a power of two.  Each index is written only by its
+// owner, so the acquire/release pairs are the only synchronization needed.
+template <typename T, size_t N>
+class spsc_queue_t
+{
+  static_assert(N && !(N & (N - 1)), "capacity must be a power of two");
+
+ public:
+  spsc_queue_t() : head(0), tail(0) {}
+
+  // producer side
+  bool full() const
+  {
+    return tail.load(std::memory_order_relaxed) -
+           head.load(std::memory_order_acquire) == N;
+  }
+  bool push(const T& x)
+  {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == N)
+      return false;
+    buf[t % N] = x;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  // consumer side
+  bool empty() const
+  {
+    return head.load(std::memory_order_relaxed) ==
+           tail.load(std::memory_order_acquire);
+  }
+  const T& front() const
+  {
+    return buf[head.load(std::memory_order_relaxed) % N];
+  }
+  void pop()
+  {
+    head.store(head.load(std::memory_order_relaxed) + 1,
+               std::memory_order_release);
+  }
+  bool pop(T& x)
+  {
+    if (empty())
+      return false;
+    x = front();
+    pop();
+    return true;
+  }
+
+ private:
+  // keep the indices on separate cache lines, so the two threads do not
+  // bounce a line between them on every operation
+  std::atomic<size_t> head;
+  char pad[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> tail;
+  char pad2[64 - sizeof(std::atomic<size_t>)];
+  T buf[N];
+};
+
+#endif
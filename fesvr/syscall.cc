@@ -5,13 +5,24 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <time.h>
 #include <limits.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <termios.h>
+#ifdef __linux__
+# include <sys/sendfile.h>
+#endif
+#include <algorithm>
 #include <sstream>
 #include <iostream>
+#include <map>
+#include <list>
+#include <mutex>
+#include <tuple>
 using namespace std::placeholders;
 
 #define RISCV_AT_FDCWD -100
@@ -48,8 +59,44 @@ struct riscv_stat
       __unused4(0), __unused5(0) {}
 };
 
+struct riscv_iovec
+{
+  uint64_t base;
+  uint64_t len;
+};
+
+struct riscv_timespec
+{
+  int64_t sec;
+  int64_t nsec;
+};
+
+struct riscv_timeval
+{
+  int64_t sec;
+  int64_t usec;
+};
+
+#define RISCV_IOV_MAX 1024
+
+// Layout of a batched syscall ring in target memory.  The target fills
+// slots[head % size] with the same 8-word frame used by single proxied
+// syscalls and advances head; on a syscall_ring doorbell the host services
+// every slot from tail up to head, overwriting word 0 of each with the
+// return value, and then advances tail.
+struct riscv_syscall_ring
+{
+  uint64_t size; // number of slots, a power of 2
+  uint64_t head; // written by the target
+  uint64_t tail; // written by the host
+  uint64_t reserved;
+  // uint64_t slots[size][8];
+};
+
+#define RISCV_SYSCALL_FRAME_WORDS 8
+
 syscall_t::syscall_t(htif_t* htif)
-  : htif(htif), memif(&htif->memif()), table(2048)
+  : htif(htif), memif(&htif->memif()), table(2048), file_cache(false)
 {
   table[17] = &syscall_t::sys_getcwd;
   table[25] = &syscall_t::sys_fcntl;
@@ -62,18 +109,27 @@ syscall_t::syscall_t(htif_t* htif)
   table[49] = &syscall_t::sys_chdir;
   table[56] = &syscall_t::sys_openat;
   table[57] = &syscall_t::sys_close;
+  table[61] = &syscall_t::sys_getdents64;
   table[62] = &syscall_t::sys_lseek;
   table[63] = &syscall_t::sys_read;
   table[64] = &syscall_t::sys_write;
+  table[65] = &syscall_t::sys_readv;
+  table[66] = &syscall_t::sys_writev;
   table[67] = &syscall_t::sys_pread;
   table[68] = &syscall_t::sys_pwrite;
+  table[69] = &syscall_t::sys_preadv;
+  table[70] = &syscall_t::sys_pwritev;
+  table[71] = &syscall_t::sys_sendfile;
   table[79] = &syscall_t::sys_fstatat;
   table[80] = &syscall_t::sys_fstat;
   table[93] = &syscall_t::sys_exit;
+  table[113] = &syscall_t::sys_clock_gettime;
+  table[169] = &syscall_t::sys_gettimeofday;
   table[1039] = &syscall_t::sys_lstat;
   table[2011] = &syscall_t::sys_getmainvars;
 
   register_command(0, std::bind(&syscall_t::handle_syscall, this, _1), "syscall");
+  register_command(1, std::bind(&syscall_t::handle_syscall_ring, this, _1), "syscall_ring");
 
   int stdin_fd = dup(0), stdout_fd0 = dup(1), stdout_fd1 = dup(1);
   if (stdin_fd < 0 || stdout_fd0 < 0 || stdout_fd1 < 0)
@@ -116,6 +172,126 @@ void syscall_t::handle_syscall(command_t cmd)
   cmd.respond(1);
 }
 
+void syscall_t::handle_syscall_ring(command_t cmd)
+{
+  addr_t ring = cmd.payload();
+  riscv_syscall_ring hdr;
+  memif->read(ring, sizeof(hdr), &hdr);
+
+  if (hdr.size == 0 || (hdr.size & (hdr.size-1)) || hdr.head - hdr.tail > hdr.size)
+    throw std::runtime_error("bad syscall ring @ " + std::to_string(ring));
+
+  const size_t frame_bytes = RISCV_SYSCALL_FRAME_WORDS * sizeof(reg_t);
+  const size_t max_batch = 64;
+  addr_t slots = ring + sizeof(hdr);
+  std::vector<reg_t> frames(max_batch * RISCV_SYSCALL_FRAME_WORDS);
+
+  // Service the pending slots in contiguous batches of at most max_batch
+  // frames, each fetched and written back with a single bulk transfer, so
+  // the buffer stays small however large the target says the ring is.
+  while (hdr.tail != hdr.head && htif->exitcode == 0)
+  {
+    size_t first = hdr.tail & (hdr.size-1);
+    size_t n = std::min<size_t>(hdr.head - hdr.tail, hdr.size - first);
+    n = std::min(n, max_batch);
+    addr_t base = slots + first * frame_bytes;
+
+    memif->read(base, n * frame_bytes, &frames[0]);
+
+    size_t done;
+    for (done = 0; done < n && htif->exitcode == 0; done++)
+      execute(&frames[done * RISCV_SYSCALL_FRAME_WORDS]);
+
+    memif->write(base, done * frame_bytes, &frames[0]);
+    hdr.tail += done;
+  }
+
+  memif->write_uint64(ring + offsetof(riscv_syscall_ring, tail), hdr.tail);
+  cmd.respond(1);
+}
+
+#ifdef __APPLE__
+# define st_mtim st_mtimespec
+# define st_ctim st_ctimespec
+#endif
+
+std::shared_ptr<const cached_file_t> cached_file_t::get(int fd)
+{
+  typedef std::tuple<dev_t, ino_t, off_t, time_t, long, time_t, long> key_t;
+  typedef std::list<std::pair<key_t, std::shared_ptr<const cached_file_t>>> lru_t;
+  static std::mutex lock;
+  static lru_t lru;
+  static std::map<key_t, lru_t::iterator> files;
+  static size_t cached_bytes = 0;
+  // larger files are read through the host descriptor as usual
+  const off_t max_file = 16 << 20;
+  const size_t max_cached = 64 << 20;
+
+  struct stat s;
+  if (fstat(fd, &s) < 0 || !S_ISREG(s.st_mode) || s.st_size == 0 || s.st_size > max_file)
+    return NULL;
+
+  key_t key(s.st_dev, s.st_ino, s.st_size, s.st_mtim.tv_sec, s.st_mtim.tv_nsec,
+            s.st_ctim.tv_sec, s.st_ctim.tv_nsec);
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = files.find(key);
+    if (it != files.end())
+    {
+      lru.splice(lru.begin(), lru, it->second);
+      return it->second->second;
+    }
+  }
+
+  std::vector<char> data(s.st_size);
+  if (pread(fd, data.data(), s.st_size, 0) != s.st_size)
+    return NULL;
+  // don't cache a file that was modified while we were reading it
+  struct stat after;
+  if (fstat(fd, &after) < 0 ||
+      key != key_t(after.st_dev, after.st_ino, after.st_size,
+                   after.st_mtim.tv_sec, after.st_mtim.tv_nsec,
+                   after.st_ctim.tv_sec, after.st_ctim.tv_nsec))
+    return NULL;
+
+  auto file = std::make_shared<const cached_file_t>(std::move(data));
+  std::lock_guard<std::mutex> guard(lock);
+  if (files.count(key))
+    return files[key]->second;
+
+  // forget earlier versions of this file, then the least recently used
+  // files until the new one fits; open descriptors keep their own copies
+  for (auto i = lru.begin(); i != lru.end(); )
+  {
+    if (std::get<0>(i->first) == s.st_dev && std::get<1>(i->first) == s.st_ino)
+    {
+      cached_bytes -= i->second->data.size();
+      files.erase(i->first);
+      i = lru.erase(i);
+    }
+    else
+      i++;
+  }
+  while (!lru.empty() && cached_bytes + s.st_size > max_cached)
+  {
+    cached_bytes -= lru.back().second->data.size();
+    files.erase(lru.back().first);
+    lru.pop_back();
+  }
+
+  lru.emplace_front(key, file);
+  files[key] = lru.begin();
+  cached_bytes += s.st_size;
+  return file;
+}
+
+syscall_t::cached_fd_t* syscall_t::lookup_cached(reg_t fd)
+{
+  if (fd >= cached_fds.size() || !cached_fds[fd].file)
+    return NULL;
+  return &cached_fds[fd];
+}
+
 reg_t syscall_t::sys_exit(reg_t code, reg_t a1, reg_t a2, reg_t a3, reg_t a4, reg_t a5, reg_t a6)
 {
   htif->exitcode = code << 1 | 1;
@@ -129,6 +305,15 @@ static reg_t sysret_errno(sreg_t ret)
 
 reg_t syscall_t::sys_read(reg_t fd, reg_t pbuf, reg_t len, reg_t a3, reg_t a4, reg_t a5, reg_t a6)
 {
+  if (cached_fd_t* c = lookup_cached(fd))
+  {
+    size_t n = std::min<size_t>(len, c->file->available(c->pos));
+    if (n)
+      memif->write(pbuf, n, c->file->data.data() + c->pos);
+    c->pos += n;
+    return n;
+  }
+
   std::vector<char> buf(len);
   ssize_t ret = read(fds.lookup(fd), &buf[0], len);
   reg_t ret_errno = sysret_errno(ret);
@@ -139,6 +324,16 @@ reg_t syscall_t::sys_read(reg_t fd, reg_t pbuf, reg_t len, reg_t a3, reg_t a4, r
 
 reg_t syscall_t::sys_pread(reg_t fd, reg_t pbuf, reg_t len, reg_t off, reg_t a4, reg_t a5, reg_t a6)
 {
+  if (cached_fd_t* c = lookup_cached(fd))
+  {
+    if (sreg_t(off) < 0)
+      return -EINVAL;
+    size_t n = std::min<size_t>(len, c->file->available(off));
+    if (n)
+      memif->write(pbuf, n, c->file->data.data() + off);
+    return n;
+  }
+
   std::vector<char> buf(len);
   ssize_t ret = pread(fds.lookup(fd), &buf[0], len, off);
   reg_t ret_errno = sysret_errno(ret);
@@ -163,17 +358,172 @@ reg_t syscall_t::sys_pwrite(reg_t fd, reg_t pbuf, reg_t len, reg_t off, reg_t a4
   return ret;
 }
 
+// Fetch the target's iovec array in one transfer.  The vectored calls below
+// then move data between the target ranges and one contiguous host buffer,
+// so each of them costs a single host syscall.
+bool syscall_t::get_iovecs(reg_t piov, reg_t iovcnt, std::vector<memif_iovec_t>& iov, size_t& len)
+{
+  if (iovcnt > RISCV_IOV_MAX)
+    return false;
+
+  std::vector<riscv_iovec> riov(iovcnt);
+  if (iovcnt)
+    memif->read(piov, iovcnt * sizeof(riscv_iovec), &riov[0]);
+
+  iov.resize(iovcnt);
+  len = 0;
+  for (size_t i = 0; i < iovcnt; i++)
+  {
+    if (riov[i].len > SSIZE_MAX - len)
+      return false;
+    iov[i].base = riov[i].base;
+    iov[i].len = riov[i].len;
+    len += riov[i].len;
+  }
+  return true;
+}
+
+// Trim an iovec array to cover only the first len bytes.
+static size_t trim_iovecs(std::vector<memif_iovec_t>& iov, size_t len)
+{
+  size_t n;
+  for (n = 0; n < iov.size() && len; n++)
+  {
+    iov[n].len = std::min<size_t>(iov[n].len, len);
+    len -= iov[n].len;
+  }
+  return n;
+}
+
+reg_t syscall_t::sys_readv(reg_t fd, reg_t piov, reg_t iovcnt, reg_t a3, reg_t a4, reg_t a5, reg_t a6)
+{
+  std::vector<memif_iovec_t> iov;
+  size_t len;
+  if (!get_iovecs(piov, iovcnt, iov, len))
+    return -EINVAL;
+
+  if (cached_fd_t* c = lookup_cached(fd))
+  {
+    size_t n = std::min<size_t>(len, c->file->available(c->pos));
+    memif->writev(iov.data(), trim_iovecs(iov, n), c->file->data.data() + c->pos);
+    c->pos += n;
+    return n;
+  }
+
+  std::vector<char> buf(len);
+  ssize_t ret = read(fds.lookup(fd), buf.data(), len);
+  reg_t ret_errno = sysret_errno(ret);
+  if (ret > 0)
+    memif->writev(iov.data(), trim_iovecs(iov, ret), buf.data());
+  return ret_errno;
+}
+
+reg_t syscall_t::sys_preadv(reg_t fd, reg_t piov, reg_t iovcnt, reg_t off, reg_t a4, reg_t a5, reg_t a6)
+{
+  std::vector<memif_iovec_t> iov;
+  size_t len;
+  if (!get_iovecs(piov, iovcnt, iov, len))
+    return -EINVAL;
+
+  if (cached_fd_t* c = lookup_cached(fd))
+  {
+    if (sreg_t(off) < 0)
+      return -EINVAL;
+    size_t n = std::min<size_t>(len, c->file->available(off));
+    memif->writev(iov.data(), trim_iovecs(iov, n), c->file->data.data() + off);
+    return n;
+  }
+
+  std::vector<char> buf(len);
+  ssize_t ret = pread(fds.lookup(fd), buf.data(), len, off);
+  reg_t ret_errno = sysret_errno(ret);
+  if (ret > 0)
+    memif->writev(iov.data(), trim_iovecs(iov, ret), buf.data());
+  return ret_errno;
+}
+
+reg_t syscall_t::sys_writev(reg_t fd, reg_t piov, reg_t iovcnt, reg_t a3, reg_t a4, reg_t a5, reg_t a6)
+{
+  std::vector<memif_iovec_t> iov;
+  size_t len;
+  if (!get_iovecs(piov, iovcnt, iov, len))
+    return -EINVAL;
+
+  std::vector<char> buf(len);
+  memif->readv(iov.data(), iov.size(), buf.data());
+  return sysret_errno(write(fds.lookup(fd), buf.data(), len));
+}
+
+reg_t syscall_t::sys_pwritev(reg_t fd, reg_t piov, reg_t iovcnt, reg_t off, reg_t a4, reg_t a5, reg_t a6)
+{
+  std::vector<memif_iovec_t> iov;
+  size_t len;
+  if (!get_iovecs(piov, iovcnt, iov, len))
+    return -EINVAL;
+
+  std::vector<char> buf(len);
+  memif->readv(iov.data(), iov.size(), buf.data());
+  return sysret_errno(pwrite(fds.lookup(fd), buf.data(), len, off));
+}
+
+reg_t syscall_t::sys_sendfile(reg_t out_fd, reg_t in_fd, reg_t poff, reg_t count, reg_t a4, reg_t a5, reg_t a6)
+{
+#ifdef __linux__
+  // the data never passes through target memory, only the offset does
+  if (poff == 0)
+  {
+    // a cached fd's position is tracked here rather than by the host
+    if (cached_fd_t* c = lookup_cached(in_fd))
+      return sysret_errno(sendfile(fds.lookup(out_fd), fds.lookup(in_fd), &c->pos, count));
+    return sysret_errno(sendfile(fds.lookup(out_fd), fds.lookup(in_fd), NULL, count));
+  }
+
+  off_t off = memif->read_int64(poff);
+  reg_t ret = sysret_errno(sendfile(fds.lookup(out_fd), fds.lookup(in_fd), &off, count));
+  if (sreg_t(ret) >= 0)
+    memif->write_int64(poff, off);
+  return ret;
+#else
+  return -ENOSYS;
+#endif
+}
+
+reg_t syscall_t::sys_getdents64(reg_t fd, reg_t pbuf, reg_t len, reg_t a3, reg_t a4, reg_t a5, reg_t a6)
+{
+#ifdef SYS_getdents64
+  // struct linux_dirent64 has the same layout on every Linux ABI
+  std::vector<char> buf(len);
+  ssize_t ret = syscall(SYS_getdents64, fds.lookup(fd), buf.data(), len);
+  reg_t ret_errno = sysret_errno(ret);
+  if (ret > 0)
+    memif->write(pbuf, ret, &buf[0]);
+  return ret_errno;
+#else
+  return -ENOSYS;
+#endif
+}
+
 reg_t syscall_t::sys_close(reg_t fd, reg_t a1, reg_t a2, reg_t a3, reg_t a4, reg_t a5, reg_t a6)
 {
   if (close(fds.lookup(fd)) < 0)
     return sysret_errno(-1);
   fds.dealloc(fd);
+  if (cached_fd_t* c = lookup_cached(fd))
+    c->file.reset();
   return 0;
 }
 
 reg_t syscall_t::sys_lseek(reg_t fd, reg_t ptr, reg_t dir, reg_t a3, reg_t a4, reg_t a5, reg_t a6)
 {
-  return sysret_errno(lseek(fds.lookup(fd), ptr, dir));
+  cached_fd_t* c = lookup_cached(fd);
+  // the host file position of a cached fd is stale; sync it before seeking
+  if (c && lseek(fds.lookup(fd), c->pos, SEEK_SET) < 0)
+    return sysret_errno(-1);
+
+  off_t ret = lseek(fds.lookup(fd), ptr, dir);
+  if (c && ret >= 0)
+    c->pos = ret;
+  return sysret_errno(ret);
 }
 
 reg_t syscall_t::sys_fstat(reg_t fd, reg_t pbuf, reg_t a2, reg_t a3, reg_t a4, reg_t a5, reg_t a6)
@@ -224,7 +574,19 @@ reg_t syscall_t::sys_openat(reg_t dirfd, reg_t pname, reg_t len, reg_t flags, re
   int fd = sysret_errno(AT_SYSCALL(openat, dirfd, &name[0], flags, mode));
   if (fd < 0)
     return sysret_errno(-1);
-  return fds.alloc(fd);
+
+  reg_t tfd = fds.alloc(fd);
+  if (file_cache && (flags & O_ACCMODE) == O_RDONLY)
+  {
+    if (auto file = cached_file_t::get(fd))
+    {
+      if (tfd >= cached_fds.size())
+        cached_fds.resize(tfd + 1);
+      cached_fds[tfd].file = file;
+      cached_fds[tfd].pos = 0;
+    }
+  }
+  return tfd;
 }
 
 reg_t syscall_t::sys_fstatat(reg_t dirfd, reg_t pname, reg_t len, reg_t pbuf, reg_t flags, reg_t a5, reg_t a6)
@@ -337,29 +699,61 @@ reg_t syscall_t::sys_chdir(reg_t path, reg_t a1, reg_t a2, reg_t a3, reg_t a4, r
   return sysret_errno(chdir(buf.data()));
 }
 
-void syscall_t::dispatch(reg_t mm)
+reg_t syscall_t::sys_clock_gettime(reg_t clk_id, reg_t pts, reg_t a2, reg_t a3, reg_t a4, reg_t a5, reg_t a6)
 {
-  reg_t magicmem[8];
-  memif->read(mm, sizeof(magicmem), magicmem);
+  struct timespec ts;
+  reg_t ret = sysret_errno(clock_gettime(clk_id, &ts));
+  if (ret == 0)
+  {
+    riscv_timespec rts = {ts.tv_sec, ts.tv_nsec};
+    memif->write(pts, sizeof(rts), &rts);
+  }
+  return ret;
+}
 
+reg_t syscall_t::sys_gettimeofday(reg_t ptv, reg_t ptz, reg_t a2, reg_t a3, reg_t a4, reg_t a5, reg_t a6)
+{
+  // the timezone argument is obsolete; like Linux, leave it untouched
+  struct timeval tv;
+  reg_t ret = sysret_errno(gettimeofday(&tv, NULL));
+  if (ret == 0 && ptv)
+  {
+    riscv_timeval rtv = {tv.tv_sec, tv.tv_usec};
+    memif->write(ptv, sizeof(rtv), &rtv);
+  }
+  return ret;
+}
+
+void syscall_t::execute(reg_t magicmem[8])
+{
   reg_t n = magicmem[0];
   if (n >= table.size() || !table[n])
     throw std::runtime_error("bad syscall #" + std::to_string(n));
 
   magicmem[0] = (this->*table[n])(magicmem[1], magicmem[2], magicmem[3], magicmem[4], magicmem[5], magicmem[6], magicmem[7]);
+}
 
+void syscall_t::dispatch(reg_t mm)
+{
+  reg_t magicmem[RISCV_SYSCALL_FRAME_WORDS];
+  memif->read(mm, sizeof(magicmem), magicmem);
+  execute(magicmem);
   memif->write(mm, sizeof(magicmem), magicmem);
 }
 
 reg_t fds_t::alloc(int fd)
 {
   reg_t i;
-  for (i = 0; i < fds.size(); i++)
-    if (fds[i] == -1)
-      break;
-
-  if (i == fds.size())
-    fds.resize(i+1);
+  if (!free_fds.empty())
+  {
+    i = free_fds.top();
+    free_fds.pop();
+  }
+  else
+  {
+    i = fds.size();
+    fds.push_back(-1);
+  }
 
   fds[i] = fd;
   return i;
@@ -367,7 +761,11 @@ reg_t fds_t::alloc(int fd)
 
 void fds_t::dealloc(reg_t fd)
 {
+  if (fd >= fds.size() || fds[fd] == -1)
+    return;
+
   fds[fd] = -1;
+  free_fds.push(fd);
 }
 
 int fds_t::lookup(reg_t fd)
@@ -7,6 +7,11 @@
 #include "memif.h"
 #include <vector>
 #include <string>
+#include <memory>
+#include <queue>
+#include <functional>
+#include <algorithm>
+#include <sys/types.h>
 
 class syscall_t;
 typedef reg_t (syscall_t::*syscall_func_t)(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
@@ -22,6 +27,28 @@ class fds_t
   int lookup(reg_t fd);
  private:
   std::vector<int> fds;
+  // closed slots below fds.size(), lowest first, so that alloc keeps the
+  // POSIX lowest-available-descriptor semantics without a linear scan
+  std::priority_queue<reg_t, std::vector<reg_t>, std::greater<reg_t>> free_fds;
+};
+
+// A snapshot of a read-only host file, taken when the target opens it, so
+// reads never touch the host file again and cannot fault if it is truncated.
+// Snapshots are shared by every syscall_t in the process and keyed on the
+// file's identity, size and nanosecond mtime/ctime; a bounded LRU keeps
+// recently closed files, so inputs that are opened over and over are read
+// from the host only once.  Files too large to snapshot are not cached.
+class cached_file_t
+{
+ public:
+  cached_file_t(std::vector<char>&& data) : data(std::move(data)) {}
+
+  static std::shared_ptr<const cached_file_t> get(int fd);
+
+  // bytes that can be served from offset off
+  size_t available(size_t off) const { return data.size() - std::min(off, data.size()); }
+
+  const std::vector<char> data;
 };
 
 class syscall_t : public device_t
@@ -30,7 +57,8 @@ class syscall_t : public device_t
   syscall_t(htif_t*);
 
   void set_chroot(const char* where);
-  
+  void set_file_cache(bool enable) { file_cache = enable; }
+
  private:
   const char* identity() { return "syscall_proxy"; }
 
@@ -40,18 +68,35 @@ class syscall_t : public device_t
   fds_t fds;
 
   void handle_syscall(command_t cmd);
+  void handle_syscall_ring(command_t cmd);
   void dispatch(addr_t mm);
+  void execute(reg_t magicmem[8]);
 
   std::string chroot;
   std::string do_chroot(const char* fn);
   std::string undo_chroot(const char* fn);
 
+  struct cached_fd_t
+  {
+    std::shared_ptr<const cached_file_t> file;
+    off_t pos;
+  };
+  bool file_cache;
+  std::vector<cached_fd_t> cached_fds;
+  cached_fd_t* lookup_cached(reg_t fd);
+
   reg_t sys_exit(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
   reg_t sys_openat(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
   reg_t sys_read(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
   reg_t sys_pread(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
   reg_t sys_write(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
   reg_t sys_pwrite(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
+  reg_t sys_readv(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
+  reg_t sys_preadv(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
+  reg_t sys_writev(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
+  reg_t sys_pwritev(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
+  reg_t sys_sendfile(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
+  reg_t sys_getdents64(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
   reg_t sys_close(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
   reg_t sys_lseek(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
   reg_t sys_fstat(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
@@ -67,6 +112,10 @@ class syscall_t : public device_t
   reg_t sys_getcwd(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
   reg_t sys_getmainvars(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
   reg_t sys_chdir(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
+  reg_t sys_clock_gettime(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
+  reg_t sys_gettimeofday(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
+
+  bool get_iovecs(reg_t piov, reg_t iovcnt, std::vector<memif_iovec_t>& iov, size_t& len);
 };
 
 #endif
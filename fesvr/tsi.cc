@@ -1,6 +1,7 @@
 #include "tsi.h"
 #include <cstdio>
 #include <cstdlib>
+#include <sched.h>
 
 #define NHARTS_MAX 16
 
@@ -13,14 +14,31 @@ void tsi_t::host_thread(void *arg)
     tsi->target->switch_to();
 }
 
-tsi_t::tsi_t(int argc, char** argv) : htif_t(argc, argv)
+void* tsi_t::host_pthread_main(void *arg)
 {
-  target = context_t::current();
-  host.init(host_thread, this);
+  try {
+    static_cast<tsi_t*>(arg)->run();
+  } catch (host_stopped_t&) {
+  }
+  return NULL;
+}
+
+tsi_t::tsi_t(int argc, char** argv)
+  : htif_t(argc, argv), host_started(false), stop_host(false)
+{
+  if (!host_is_threaded()) {
+    target = context_t::current();
+    host.init(host_thread, this, get_host_stack_size());
+  }
 }
 
 tsi_t::~tsi_t(void)
 {
+  // the host thread notices this the next time it waits on the target
+  if (host_started) {
+    stop_host = true;
+    pthread_join(host_pthread, NULL);
+  }
 }
 
 #define MSIP_BASE 0x2000000
@@ -33,10 +51,16 @@ void tsi_t::reset()
   write_chunk(MSIP_BASE, sizeof(uint32_t), &one);
 }
 
+void tsi_t::push_word(uint32_t word)
+{
+  while (!in_data.push(word))
+    switch_to_target();
+}
+
 void tsi_t::push_addr(addr_t addr)
 {
   for (int i = 0; i < SAI_ADDR_CHUNKS; i++) {
-    in_data.push_back(addr & 0xffffffff);
+    push_word(addr & 0xffffffff);
     addr = addr >> 32;
   }
 }
@@ -44,7 +68,7 @@ void tsi_t::push_addr(addr_t addr)
 void tsi_t::push_len(addr_t len)
 {
   for (int i = 0; i < SAI_LEN_CHUNKS; i++) {
-    in_data.push_back(len & 0xffffffff);
+    push_word(len & 0xffffffff);
     len = len >> 32;
   }
 }
@@ -54,7 +78,7 @@ void tsi_t::read_chunk(addr_t taddr, size_t nbytes, void* dst)
   uint32_t *result = static_cast<uint32_t*>(dst);
   size_t len = nbytes / sizeof(uint32_t);
 
-  in_data.push_back(SAI_CMD_READ);
+  push_word(SAI_CMD_READ);
   push_addr(taddr);
   push_len(len - 1);
 
@@ -62,7 +86,7 @@ void tsi_t::read_chunk(addr_t taddr, size_t nbytes, void* dst)
     while (out_data.empty())
       switch_to_target();
     result[i] = out_data.front();
-    out_data.pop_front();
+    out_data.pop();
   }
 }
 
@@ -71,22 +95,24 @@ void tsi_t::write_chunk(addr_t taddr, size_t nbytes, const void* src)
   const uint32_t *src_data = static_cast<const uint32_t*>(src);
   size_t len = nbytes / sizeof(uint32_t);
 
-  in_data.push_back(SAI_CMD_WRITE);
+  push_word(SAI_CMD_WRITE);
   push_addr(taddr);
   push_len(len - 1);
 
-  in_data.insert(in_data.end(), src_data, src_data + len);
+  for (size_t i = 0; i < len; i++)
+    push_word(src_data[i]);
 }
 
 void tsi_t::send_word(uint32_t word)
 {
-  out_data.push_back(word);
+  while (!out_data.push(word))
+    switch_to_host();
 }
 
 uint32_t tsi_t::recv_word(void)
 {
   uint32_t word = in_data.front();
-  in_data.pop_front();
+  in_data.pop();
   return word;
 }
 
@@ -97,19 +123,30 @@ bool tsi_t::data_available(void)
 
 void tsi_t::switch_to_host(void)
 {
-  host.switch_to();
+  if (!host_is_threaded()) {
+    host.switch_to();
+  } else if (!host_started) {
+    if (pthread_create(&host_pthread, NULL, host_pthread_main, this) != 0)
+      abort();
+    host_started = true;
+  }
 }
 
 void tsi_t::switch_to_target(void)
 {
-  target->switch_to();
+  if (!host_is_threaded())
+    target->switch_to();
+  else if (stop_host.load(std::memory_order_relaxed))
+    throw host_stopped_t(); // unwinds to host_pthread_main
+  else
+    sched_yield();
 }
 
 void tsi_t::tick(bool out_valid, uint32_t out_bits, bool in_ready)
 {
   if (out_valid && out_ready())
-    out_data.push_back(out_bits);
+    out_data.push(out_bits);
 
   if (in_valid() && in_ready)
-    in_data.pop_front();
+    in_data.pop();
 }
@@ -3,11 +3,13 @@
 
 #include "htif.h"
 #include "context.h"
+#include "spsc_queue.h"
 
+#include <atomic>
 #include <string>
 #include <vector>
-#include <deque>
 #include <stdint.h>
+#include <pthread.h>
 
 #define SAI_CMD_READ 0
 #define SAI_CMD_WRITE 1
@@ -28,7 +30,7 @@ class tsi_t : public htif_t
 
   uint32_t in_bits() { return in_data.front(); }
   bool in_valid() { return !in_data.empty(); }
-  bool out_ready() { return true; }
+  bool out_ready() { return !out_data.full(); }
   void tick(bool out_valid, uint32_t out_bits, bool in_ready);
 
  protected:
@@ -45,13 +47,23 @@ class tsi_t : public htif_t
  private:
   context_t host;
   context_t* target;
-  std::deque<uint32_t> in_data;
-  std::deque<uint32_t> out_data;
+  // With +host-thread, the host runs on its own thread, started by the
+  // first switch_to_host(), and these queues are its only link to tick().
+  bool host_started;
+  pthread_t host_pthread;
+  std::atomic<bool> stop_host; // set by the destructor
+  struct host_stopped_t {};
 
+  static const size_t QUEUE_SIZE = 4096;
+  spsc_queue_t<uint32_t, QUEUE_SIZE> in_data;  // host to target
+  spsc_queue_t<uint32_t, QUEUE_SIZE> out_data; // target to host
+
+  void push_word(uint32_t word);
   void push_addr(addr_t addr);
   void push_len(addr_t len);
 
   static void host_thread(void *tsi);
+  static void* host_pthread_main(void *tsi);
 };
 
 #endif